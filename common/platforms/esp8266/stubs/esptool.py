@@ -1065,6 +1065,17 @@ def wrap_stub(args):
             len(stub.get('data', '')), stub.get('data_start', 0),
             args.entry, stub['entry']))
 
+    if args.format == 'bin':
+        # Header of little-endian words followed by code and data, see README.
+        data = stub.get('data', '')
+        sys.stdout.write(struct.pack(
+            '<4sIIIIIII', 'STUB', stub['num_params'], stub['params_start'],
+            stub['code_start'], len(stub['code']), stub.get('data_start', 0),
+            len(data), stub['entry']))
+        sys.stdout.write(stub['code'])
+        sys.stdout.write(data)
+        return
+
     jstub = dict(stub)
     jstub['code'] = hexify(stub['code'])
     if 'data' in stub:
@@ -1202,9 +1213,10 @@ def main():
         'erase_flash',
         help='Perform Chip Erase on SPI flash')
 
-    parser_wrap_stub = subparsers.add_parser('wrap_stub', help='Wrap stub and output a JSON object')
+    parser_wrap_stub = subparsers.add_parser('wrap_stub', help='Wrap stub and output a JSON object or a binary image')
     parser_wrap_stub.add_argument('input')
     parser_wrap_stub.add_argument('--entry', default='stub_main')
+    parser_wrap_stub.add_argument('--format', choices=['json', 'bin'], default='json')
 
     parser_run_stub = subparsers.add_parser('run_stub', help='Run stub on a device')
     parser_run_stub.add_argument('--entry', default='stub_main')
@@ -0,0 +1,11 @@
+/*
+ * Copyright (c) 2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Compiles the parts of miniz used by the stubs. Unused functions are
+ * discarded by the linker.
+ */
+
+#define NDEBUG
+
+#include "miniz_stub.h"
@@ -0,0 +1,17 @@
+#ifndef CS_COMMON_PLATFORMS_ESP8266_STUBS_MINIZ_STUB_H_
+#define CS_COMMON_PLATFORMS_ESP8266_STUBS_MINIZ_STUB_H_
+
+/*
+ * Only the inflater (tinfl) part of miniz is used by the stubs, everything
+ * that needs libc beyond memcpy and memset is disabled.
+ * Define MINIZ_HEADER_FILE_ONLY before including this to get declarations only.
+ */
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_NO_MALLOC
+
+#include "common/miniz.c"
+
+#endif /* CS_COMMON_PLATFORMS_ESP8266_STUBS_MINIZ_STUB_H_ */
@@ -35,6 +35,7 @@ void SPIReadModeCnfig(uint32_t a);
 void Cache_Read_Disable();
 
 void memset(void *addr, uint8_t c, uint32_t len);
+int memcmp(const void *s1, const void *s2, uint32_t n);
 
 void ets_delay_us(uint32_t delay_micros);
 
@@ -4,18 +4,32 @@ void SLIP_send(const void *pkt, uint32_t size) {
   send_packet(pkt, size);
 }
 
-uint32_t SLIP_recv(void *pkt, uint32_t max_len) {
+/* timeout_us == 0 means wait forever. */
+static int recv_char(uint8_t *c, uint32_t timeout_us, uint32_t *waited_us) {
+  if (timeout_us == 0) {
+    *c = uart_rx_one_char_block();
+    return 0;
+  }
+  while (uart_rx_one_char(c) != 0) {
+    if (*waited_us >= timeout_us) return -1;
+    ets_delay_us(10);
+    *waited_us += 10;
+  }
+  return 0;
+}
+
+uint32_t SLIP_recv_timeout(void *pkt, uint32_t max_len, uint32_t timeout_us) {
   uint8_t c;
-  uint32_t len = 0;
+  uint32_t len = 0, waited_us = 0;
   uint8_t *p = (uint8_t *) pkt;
   do {
-    c = uart_rx_one_char_block();
+    if (recv_char(&c, timeout_us, &waited_us) != 0) return 0;
   } while (c != '\xc0');
   while (len < max_len) {
-    c = uart_rx_one_char_block();
+    if (recv_char(&c, timeout_us, &waited_us) != 0) return 0;
     if (c == '\xc0') return len;
     if (c == '\xdb') {
-      c = uart_rx_one_char_block();
+      if (recv_char(&c, timeout_us, &waited_us) != 0) return 0;
       if (c == '\xdc') {
         c = '\xc0';
       } else if (c == '\xdd') {
@@ -29,7 +43,11 @@ uint32_t SLIP_recv(void *pkt, uint32_t max_len) {
     len++;
   }
   do {
-    c = uart_rx_one_char_block();
+    if (recv_char(&c, timeout_us, &waited_us) != 0) return 0;
   } while (c != '\xc0');
   return len;
 }
+
+uint32_t SLIP_recv(void *pkt, uint32_t max_len) {
+  return SLIP_recv_timeout(pkt, max_len, 0);
+}
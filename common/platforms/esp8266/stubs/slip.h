@@ -5,5 +5,7 @@
 
 void SLIP_send(const void *pkt, uint32_t size);
 uint32_t SLIP_recv(void *pkt, uint32_t max_len);
+/* Same as SLIP_recv, but gives up and returns 0 after timeout_us. */
+uint32_t SLIP_recv_timeout(void *pkt, uint32_t max_len, uint32_t timeout_us);
 
 #endif /* CS_COMMON_PLATFORMS_ESP8266_STUBS_SLIP_H_ */
@@ -27,6 +27,9 @@
 
 #include "slip.h"
 
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz_stub.h"
+
 /* Param: baud rate. */
 uint32_t params[1] __attribute__((section(".params")));
 
@@ -35,7 +38,12 @@ uint32_t params[1] __attribute__((section(".params")));
 #define FLASH_BLOCK_SIZE 65536
 #define UART_CLKDIV_26MHZ(B) (52000000 + B / 2) / B
 
-#define UART_BUF_SIZE 6144
+/*
+ * Receive buffer must be large enough to keep the UART busy while the flash
+ * is being erased, a block erase can take up to a second.
+ * Size is reported to the host in the greeting, host uses it for flow control.
+ */
+#define UART_BUF_SIZE 16384
 #define SPI_WRITE_SIZE 1024
 
 #define UART_RX_INTS (UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA)
@@ -59,7 +67,7 @@ int do_flash_erase(uint32_t addr, uint32_t len) {
     addr += FLASH_SECTOR_SIZE;
   }
 
-  while (len > FLASH_BLOCK_SIZE) {
+  while (len >= FLASH_BLOCK_SIZE) {
     if (SPIEraseBlock(addr / FLASH_BLOCK_SIZE) != 0) return 0x36;
     len -= FLASH_BLOCK_SIZE;
     addr += FLASH_BLOCK_SIZE;
@@ -74,12 +82,46 @@ int do_flash_erase(uint32_t addr, uint32_t len) {
   return 0;
 }
 
+/* Returns 1 if the region is all 0xff. Stops at the first non-blank word. */
+static int flash_is_blank(uint32_t addr, uint32_t len) {
+  uint32_t buf[64];
+  while (len > 0) {
+    uint32_t i, n = len;
+    if (n > sizeof(buf)) n = sizeof(buf);
+    if (SPIRead(addr, buf, n) != 0) return 0;
+    for (i = 0; i < n / 4; i++) {
+      if (buf[i] != 0xffffffff) return 0;
+    }
+    addr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int need_erase(uint32_t erase, uint32_t addr, uint32_t len) {
+  if (!(erase & ERASE_FLAG_SKIP_BLANK)) return 1;
+  return !flash_is_blank(addr, len);
+}
+
+/*
+ * Reads back what has just been written, so that the digest reflects actual
+ * flash contents and write failures are detected without a separate pass.
+ */
+static int verify_write(struct MD5Context *ctx, uint32_t addr) {
+  uint32_t buf[SPI_WRITE_SIZE / 4];
+  if (SPIRead(addr, buf, sizeof(buf)) != 0) return -1;
+  MD5Update(ctx, buf, sizeof(buf));
+  return 0;
+}
+
 struct uart_buf {
   uint8_t data[UART_BUF_SIZE];
   uint32_t nr;
   uint8_t *pr, *pw;
 };
 
+struct uart_buf uart_rx_buf __attribute__((section(".noinit")));
+
 void uart_isr(void *arg) {
   uint32_t int_st = READ_PERI_REG(UART_INT_ST(0));
   struct uart_buf *ub = (struct uart_buf *) arg;
@@ -97,7 +139,7 @@ void uart_isr(void *arg) {
 }
 
 int do_flash_write(uint32_t addr, uint32_t len, uint32_t erase) {
-  struct uart_buf ub;
+  struct uart_buf *ub = &uart_rx_buf;
   uint8_t digest[16];
   uint32_t num_written = 0, num_erased = 0;
   struct MD5Context ctx;
@@ -107,40 +149,46 @@ int do_flash_write(uint32_t addr, uint32_t len, uint32_t erase) {
   if (len % FLASH_SECTOR_SIZE != 0) return 0x33;
   if (SPIUnlock() != 0) return 0x34;
 
-  ub.nr = 0;
-  ub.pr = ub.pw = ub.data;
-  ets_isr_attach(ETS_UART_INUM, uart_isr, &ub);
+  ub->nr = 0;
+  ub->pr = ub->pw = ub->data;
+  ets_isr_attach(ETS_UART_INUM, uart_isr, ub);
   SET_PERI_REG_MASK(UART_INT_ENA(0), UART_RX_INTS);
   ets_isr_unmask(1 << ETS_UART_INUM);
 
   SLIP_send(&num_written, 4);
 
   while (num_written < len) {
-    volatile uint32_t *nr = &ub.nr;
+    volatile uint32_t *nr = &ub->nr;
     /* Prepare the space ahead. */
     while (erase && num_erased < num_written + SPI_WRITE_SIZE) {
       const uint32_t num_left = (len - num_erased);
-      if (num_left > FLASH_BLOCK_SIZE && addr % FLASH_BLOCK_SIZE == 0) {
-        if (SPIEraseBlock(addr / FLASH_BLOCK_SIZE) != 0) return 0x35;
+      if (num_left >= FLASH_BLOCK_SIZE && addr % FLASH_BLOCK_SIZE == 0) {
+        if (need_erase(erase, addr, FLASH_BLOCK_SIZE) &&
+            SPIEraseBlock(addr / FLASH_BLOCK_SIZE) != 0) {
+          return 0x35;
+        }
         num_erased += FLASH_BLOCK_SIZE;
       } else {
         /* len % FLASH_SECTOR_SIZE == 0 is enforced, no further checks needed */
-        if (SPIEraseSector(addr / FLASH_SECTOR_SIZE) != 0) return 0x36;
+        if (need_erase(erase, addr, FLASH_SECTOR_SIZE) &&
+            SPIEraseSector(addr / FLASH_SECTOR_SIZE) != 0) {
+          return 0x36;
+        }
         num_erased += FLASH_SECTOR_SIZE;
       }
     }
     /* Wait for data to arrive. */
     while (*nr < SPI_WRITE_SIZE) {
     }
-    MD5Update(&ctx, ub.pr, SPI_WRITE_SIZE);
-    if (SPIWrite(addr, ub.pr, SPI_WRITE_SIZE) != 0) return 0x37;
+    if (SPIWrite(addr, ub->pr, SPI_WRITE_SIZE) != 0) return 0x37;
+    if (verify_write(&ctx, addr) != 0) return 0x38;
     ets_intr_lock();
     *nr -= SPI_WRITE_SIZE;
     ets_intr_unlock();
     num_written += SPI_WRITE_SIZE;
     addr += SPI_WRITE_SIZE;
-    ub.pr += SPI_WRITE_SIZE;
-    if (ub.pr >= ub.data + UART_BUF_SIZE) ub.pr = ub.data;
+    ub->pr += SPI_WRITE_SIZE;
+    if (ub->pr >= ub->data + UART_BUF_SIZE) ub->pr = ub->data;
     SLIP_send(&num_written, 4);
   }
 
@@ -152,6 +200,150 @@ int do_flash_write(uint32_t addr, uint32_t len, uint32_t erase) {
   return 0;
 }
 
+/* Must fit in the inflater dictionary, see below. */
+#define MAX_DIFF_SECTORS 1024
+
+struct sector_digest {
+  uint32_t addr;
+  uint32_t len;
+  uint8_t digest[16];
+};
+
+/*
+ * Inflater state and its dictionary are too big for the stack and are not
+ * uploaded with the stub. Output is flushed to flash straight from the
+ * dictionary, which doubles as the write buffer.
+ * Sector diff request is received into the same memory.
+ */
+tinfl_decompressor inflater __attribute__((section(".noinit")));
+union {
+  uint8_t inflate_dict[TINFL_LZ_DICT_SIZE];
+  struct sector_digest sector_digests[MAX_DIFF_SECTORS];
+} bufs __attribute__((section(".noinit")));
+
+static void send_write_ack(uint32_t num_consumed, uint32_t num_written) {
+  uint32_t ack[2] = {num_consumed, num_written};
+  SLIP_send(ack, sizeof(ack));
+}
+
+int do_flash_write_deflated(uint32_t addr, uint32_t len, uint32_t erase,
+                            uint32_t clen) {
+  struct uart_buf *ub = &uart_rx_buf;
+  uint8_t digest[16];
+  uint32_t num_consumed = 0, num_inflated = 0, num_written = 0, num_erased = 0;
+  uint32_t dict_ofs = 0;
+  int inflate_done = 0;
+  volatile uint32_t *nr = &ub->nr;
+  struct MD5Context ctx;
+  MD5Init(&ctx);
+
+  if (addr % FLASH_SECTOR_SIZE != 0) return 0xb2;
+  if (len % FLASH_SECTOR_SIZE != 0) return 0xb3;
+  if (SPIUnlock() != 0) return 0xb4;
+
+  tinfl_init(&inflater);
+  ub->nr = 0;
+  ub->pr = ub->pw = ub->data;
+  ets_isr_attach(ETS_UART_INUM, uart_isr, ub);
+  SET_PERI_REG_MASK(UART_INT_ENA(0), UART_RX_INTS);
+  ets_isr_unmask(1 << ETS_UART_INUM);
+
+  send_write_ack(num_consumed, num_written);
+
+  while (num_written < len) {
+    if (num_inflated - num_written < SPI_WRITE_SIZE) {
+      /* Not enough output for a write yet, feed the inflater. */
+      size_t in_bytes = *nr, out_bytes = TINFL_LZ_DICT_SIZE - dict_ofs;
+      uint32_t flags = 0;
+      tinfl_status status;
+      if (inflate_done) {
+        /* Stream ended short of the sector boundary, pad with zeros. */
+        memset(bufs.inflate_dict + dict_ofs, 0, len - num_inflated);
+        dict_ofs = (dict_ofs + len - num_inflated) & (TINFL_LZ_DICT_SIZE - 1);
+        num_inflated = len;
+        continue;
+      }
+      if (in_bytes > (size_t)(ub->data + UART_BUF_SIZE - ub->pr)) {
+        in_bytes = ub->data + UART_BUF_SIZE - ub->pr;
+      }
+      /*
+       * Once all the input is in, keep calling the inflater with none:
+       * it may still have output pending, e.g. the rest of a long match.
+       */
+      if (in_bytes == 0 && num_consumed < clen) continue;
+      if (num_consumed + in_bytes < clen) flags |= TINFL_FLAG_HAS_MORE_INPUT;
+      status =
+          tinfl_decompress(&inflater, ub->pr, &in_bytes, bufs.inflate_dict,
+                           bufs.inflate_dict + dict_ofs, &out_bytes, flags);
+      if (status < TINFL_STATUS_DONE) return 0xb6;
+      /* Stream is truncated. */
+      if (status == TINFL_STATUS_NEEDS_MORE_INPUT &&
+          num_consumed + in_bytes >= clen) {
+        return 0xb5;
+      }
+      ets_intr_lock();
+      *nr -= in_bytes;
+      ets_intr_unlock();
+      ub->pr += in_bytes;
+      if (ub->pr >= ub->data + UART_BUF_SIZE) ub->pr = ub->data;
+      num_consumed += in_bytes;
+      num_inflated += out_bytes;
+      dict_ofs = (dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+      if (num_inflated > len) return 0xb7;
+      if (status == TINFL_STATUS_DONE) {
+        if (len - num_inflated >= FLASH_SECTOR_SIZE) return 0xb7;
+        inflate_done = 1;
+      }
+      /* Let the host know there's space in the buffer. */
+      if (in_bytes > 0 && num_inflated - num_written < SPI_WRITE_SIZE) {
+        send_write_ack(num_consumed, num_written);
+      }
+      continue;
+    }
+    /* Prepare the space ahead. */
+    while (erase && num_erased < num_written + SPI_WRITE_SIZE) {
+      const uint32_t num_left = (len - num_erased);
+      if (num_left >= FLASH_BLOCK_SIZE && addr % FLASH_BLOCK_SIZE == 0) {
+        if (need_erase(erase, addr, FLASH_BLOCK_SIZE) &&
+            SPIEraseBlock(addr / FLASH_BLOCK_SIZE) != 0) {
+          return 0xb8;
+        }
+        num_erased += FLASH_BLOCK_SIZE;
+      } else {
+        if (need_erase(erase, addr, FLASH_SECTOR_SIZE) &&
+            SPIEraseSector(addr / FLASH_SECTOR_SIZE) != 0) {
+          return 0xb9;
+        }
+        num_erased += FLASH_SECTOR_SIZE;
+      }
+    }
+    /*
+     * Dictionary size is a multiple of SPI_WRITE_SIZE, so a full write never
+     * wraps around and is always flushed before the inflater gets to it again.
+     */
+    {
+      uint8_t *p =
+          bufs.inflate_dict + (num_written & (TINFL_LZ_DICT_SIZE - 1));
+      if (SPIWrite(addr, p, SPI_WRITE_SIZE) != 0) return 0xba;
+      if (verify_write(&ctx, addr) != 0) return 0xbb;
+    }
+    num_written += SPI_WRITE_SIZE;
+    addr += SPI_WRITE_SIZE;
+    send_write_ack(num_consumed, num_written);
+  }
+
+  /* Drain the remainder of the stream so it's not mistaken for a command. */
+  while (num_consumed + *nr < clen) {
+  }
+
+  ets_isr_mask(1 << ETS_UART_INUM);
+
+  MD5Final(digest, &ctx);
+  SLIP_send(digest, 16);
+
+  return 0;
+}
+
 int do_flash_read(uint32_t addr, uint32_t len, uint32_t block_size,
                   uint32_t max_in_flight) {
   uint8_t buf[FLASH_SECTOR_SIZE];
@@ -208,6 +400,33 @@ int do_flash_digest(uint32_t addr, uint32_t len, uint32_t digest_block_size) {
   return 0;
 }
 
+int do_flash_sector_diff(uint32_t num_sectors) {
+  uint8_t buf[FLASH_SECTOR_SIZE];
+  uint8_t digest[16];
+  uint32_t bitmap[MAX_DIFF_SECTORS / 32];
+  uint32_t i;
+  if (num_sectors > MAX_DIFF_SECTORS) return 0xc2;
+  if (SLIP_recv(bufs.sector_digests, sizeof(bufs.sector_digests)) !=
+      num_sectors * sizeof(struct sector_digest)) {
+    return 0xc3;
+  }
+  memset(bitmap, 0, sizeof(bitmap));
+  for (i = 0; i < num_sectors; i++) {
+    const struct sector_digest *sd = &bufs.sector_digests[i];
+    struct MD5Context ctx;
+    if (sd->len > sizeof(buf)) return 0xc4;
+    if (SPIRead(sd->addr, buf, sd->len) != 0) return 0xc5;
+    MD5Init(&ctx);
+    MD5Update(&ctx, buf, sd->len);
+    MD5Final(digest, &ctx);
+    if (memcmp(digest, sd->digest, sizeof(digest)) != 0) {
+      bitmap[i / 32] |= (1 << (i % 32));
+    }
+  }
+  send_packet(bitmap, (num_sectors + 31) / 32 * 4);
+  return 0;
+}
+
 int do_flash_read_chip_id(void) {
   uint32_t chip_id = 0;
   WRITE_PERI_REG(SPI_CMD(0), SPI_RDID);
@@ -218,6 +437,59 @@ int do_flash_read_chip_id(void) {
   return 0;
 }
 
+/*
+ * Echo burst and confirmation must arrive within this time after switching,
+ * otherwise the stub goes back to the previous rate.
+ */
+#define BAUD_RATE_CHECK_TIMEOUT_US 500000
+#define BAUD_RATE_CHECK_MAX_LEN 4096
+
+static void uart_tx_flush(void) {
+  while ((READ_PERI_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) &
+         UART_TXFIFO_CNT) {
+  }
+}
+
+int do_set_baud_rate(uint32_t baud_rate) {
+  /* Receive buffer is not used outside of writes. */
+  uint8_t *buf = uart_rx_buf.data;
+  const uint32_t old_div = READ_PERI_REG(UART_CLKDIV(0)) & UART_CLKDIV_CNT;
+  uint32_t len, confirm = 0;
+  if (baud_rate == 0) return 0xe2;
+  /* Ack at the current rate, host switches when it gets it. */
+  SLIP_send(&baud_rate, sizeof(baud_rate));
+  uart_tx_flush();
+  uart_div_modify(0, UART_CLKDIV_26MHZ(baud_rate));
+  len = SLIP_recv_timeout(buf, BAUD_RATE_CHECK_MAX_LEN,
+                          BAUD_RATE_CHECK_TIMEOUT_US);
+  if (len > 0) {
+    SLIP_send(buf, len);
+    if (SLIP_recv_timeout(&confirm, sizeof(confirm),
+                          BAUD_RATE_CHECK_TIMEOUT_US) == sizeof(confirm) &&
+        confirm == baud_rate) {
+      return 0;
+    }
+  }
+  /* Host could not hear us or we could not hear the host. Go back. */
+  uart_tx_flush();
+  uart_div_modify(0, old_div);
+  return 0xe3;
+}
+
+int do_read_reg(uint32_t addr) {
+  uint32_t value;
+  if (addr & 3) return 0xf2;
+  value = READ_PERI_REG(addr);
+  send_packet(&value, sizeof(value));
+  return 0;
+}
+
+static void send_greeting(void) {
+  uint32_t greeting[STUB_GREETING_LEN / 4] = {STUB_GREETING_MAGIC,
+                                              UART_BUF_SIZE, SPI_WRITE_SIZE};
+  SLIP_send(greeting, sizeof(greeting));
+}
+
 uint8_t cmd_loop(void) {
   uint8_t cmd;
   do {
@@ -247,6 +519,17 @@ uint8_t cmd_loop(void) {
         }
         break;
       }
+      case CMD_FLASH_WRITE_DEFLATED: {
+        len = SLIP_recv(args, sizeof(args));
+        if (len == 16) {
+          resp = do_flash_write_deflated(args[0] /* addr */, args[1] /* len */,
+                                         args[2] /* erase */,
+                                         args[3] /* deflated_len */);
+        } else {
+          resp = 0xb1;
+        }
+        break;
+      }
       case CMD_FLASH_READ: {
         len = SLIP_recv(args, sizeof(args));
         if (len == 16) {
@@ -268,6 +551,15 @@ uint8_t cmd_loop(void) {
         }
         break;
       }
+      case CMD_FLASH_SECTOR_DIFF: {
+        len = SLIP_recv(args, sizeof(args));
+        if (len == 4) {
+          resp = do_flash_sector_diff(args[0] /* num_sectors */);
+        } else {
+          resp = 0xc1;
+        }
+        break;
+      }
       case CMD_FLASH_READ_CHIP_ID: {
         resp = do_flash_read_chip_id();
         break;
@@ -276,6 +568,29 @@ uint8_t cmd_loop(void) {
         resp = SPIEraseChip();
         break;
       }
+      case CMD_PING: {
+        send_greeting();
+        resp = 0;
+        break;
+      }
+      case CMD_SET_BAUD_RATE: {
+        len = SLIP_recv(args, sizeof(args));
+        if (len == 4) {
+          resp = do_set_baud_rate(args[0] /* baud_rate */);
+        } else {
+          resp = 0xe1;
+        }
+        break;
+      }
+      case CMD_READ_REG: {
+        len = SLIP_recv(args, sizeof(args));
+        if (len == 4) {
+          resp = do_read_reg(args[0] /* addr */);
+        } else {
+          resp = 0xf1;
+        }
+        break;
+      }
       case CMD_BOOT_FW:
       case CMD_REBOOT: {
         resp = 0;
@@ -290,7 +605,6 @@ uint8_t cmd_loop(void) {
 
 void stub_main(void) {
   uint32_t baud_rate = params[0];
-  uint32_t greeting = 0x4941484f; /* OHAI */
   uint8_t last_cmd;
 
   /* This points at us right now, reset for next boot. */
@@ -307,7 +621,7 @@ void stub_main(void) {
   /* Give host time to get ready too. */
   ets_delay_us(50000);
 
-  SLIP_send(&greeting, 4);
+  send_greeting();
 
   last_cmd = cmd_loop();
 
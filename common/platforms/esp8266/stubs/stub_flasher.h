@@ -15,26 +15,30 @@ enum stub_cmd {
    * Write to the SPI flash.
    *
    * Args: addr, len, erase; addr and len must be SECTOR_SIZE-aligned.
-   *       If erase != 0, perform erase before writing.
+   *       If erase != 0, perform erase before writing. If erase has
+   *       ERASE_FLAG_SKIP_BLANK set, regions that are already blank
+   *       (all 0xff) are not erased.
    * Input: Stream of data to be written, note: no SLIP encapsulation here.
    * Output: SLIP packets with number of bytes written after every write.
    *         This can (and should) be used for flow control. Flasher will
-   *         write in 1K chunks but will buffer up to 4K of data
-   *         Use this feedback to keep buffer above 1K but below 4K.
-   *         Final packet will contain MD5 digest of the data written.
+   *         write in chunks and buffer up to a certain amount of data,
+   *         both sizes are reported in the greeting (see stub_main).
+   *         Use this feedback to keep the buffer non-empty but not full.
+   *         Final packet will contain MD5 digest of the data read back from
+   *         flash after writing.
    */
   CMD_FLASH_WRITE = 1,
 
   /*
    * Read from the SPI flash.
    *
-   * Args: addr, len, block_size; no alignment requirements, block_size <= 4K.
-   * Input: None.
+   * Args: addr, len, block_size, max_in_flight; no alignment requirements,
+   *       block_size <= 4K.
+   * Input: SLIP packets with cumulative number of bytes received by the host.
+   *        Host is expected to ack every data packet it receives. Stub will
+   *        not send more than max_in_flight bytes ahead of the last ack.
    * Output: Packets of up to block_size with data.
    *         Last packet is the MD5 digest of the data.
-   *
-   * Note: No flow control is performed, it is assumed that the host can cope
-   * with the inbound stream.
    */
   CMD_FLASH_READ = 2,
 
@@ -88,6 +92,85 @@ enum stub_cmd {
    * Output: None.
    */
   CMD_REBOOT = 7,
+
+  /*
+   * Write raw deflate-compressed data to the SPI flash.
+   *
+   * Args: addr, len, erase, deflated_len; addr and len must be
+   *       SECTOR_SIZE-aligned, len is the size of the inflated data.
+   *       If data inflates to less than len (but within the last sector),
+   *       the remainder is padded with zeros.
+   *       If erase != 0, perform erase before writing, ERASE_FLAG_SKIP_BLANK
+   *       is supported as well.
+   * Input: Stream of deflated_len bytes of raw deflate data (no zlib header),
+   *        no SLIP encapsulation.
+   * Output: SLIP packets with two 32-bit numbers: compressed bytes consumed
+   *         and bytes written so far. The former should be used for flow
+   *         control, same way as with CMD_FLASH_WRITE.
+   *         Final packet will contain MD5 digest of the inflated data, read
+   *         back from flash after writing.
+   */
+  CMD_FLASH_WRITE_DEFLATED = 8,
+
+  /*
+   * Compare flash contents with expected digests.
+   *
+   * Args: num_sectors; num_sectors <= 1024.
+   * Input: One SLIP packet with num_sectors entries, each consisting of
+   *        32-bit address, 32-bit length (<= 4K) and the expected 16-byte
+   *        MD5 digest of the region. No alignment requirements.
+   * Output: Bitmap of 32-bit words, bit i (LSB first) is set if region i
+   *         differs from the expected digest.
+   */
+  CMD_FLASH_SECTOR_DIFF = 9,
+
+  /*
+   * Check that the stub is running. Lets host reuse a stub that was left
+   * running by a previous session instead of uploading it again.
+   *
+   * Args: None.
+   * Input: None.
+   * Output: Same packet as the greeting sent on startup.
+   */
+  CMD_PING = 10,
+
+  /*
+   * Switch UART to a different baud rate and check that it works.
+   *
+   * Args: baud_rate.
+   * Input: After the stub acks, host switches to the new rate and sends
+   *        a test packet (up to 4K), stub echoes it back. If the echo was
+   *        received intact, host sends a packet with the new baud rate as
+   *        confirmation.
+   * Output: Ack packet with baud_rate, sent at the old rate, then the echo.
+   *         If the test packet or confirmation do not arrive within 500 ms,
+   *         stub switches back to the old rate and returns an error.
+   */
+  CMD_SET_BAUD_RATE = 11,
+
+  /*
+   * Read a 32-bit register, e.g. the efuses that hold the MAC address.
+   *
+   * Args: addr; must be 4-byte aligned.
+   * Input: None.
+   * Output: 32-bit register value.
+   */
+  CMD_READ_REG = 12,
+};
+
+/*
+ * Stub greets the host with a packet of little-endian 32-bit words: magic
+ * ("OHAI"), receive buffer size and write chunk size. Older stubs send just
+ * the magic and do not support CMD_FLASH_WRITE_DEFLATED.
+ */
+#define STUB_GREETING_MAGIC 0x4941484f
+#define STUB_GREETING_LEN 12
+
+/* Bits of the erase argument of the write commands. */
+enum stub_erase_flags {
+  ERASE_FLAG_ERASE = 1,
+  /* Check if the region is blank before erasing it, reads are much faster. */
+  ERASE_FLAG_SKIP_BLANK = 2,
 };
 
 #endif /* CS_COMMON_PLATFORMS_ESP8266_STUBS_STUB_FLASHER_H_ */
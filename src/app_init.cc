@@ -80,13 +80,38 @@ util::Status initApp(int *argc, char *argv[], Config *config,
       {"p", "platform"},
       "Target device platform. Required. Valid values: esp8266, cc3200.",
       "platform"));
-  cliOpts.append(QCommandLineOption("port", "Serial port to use.", "port"));
+  cliOpts.append(QCommandLineOption(
+      "port",
+      "Serial port to use. Use rfc2217://host:port for a port exported "
+      "over the network (e.g. by ser2net).",
+      "port"));
+  cliOpts.append(QCommandLineOption(
+      "ports",
+      "Flash several devices at once. Comma-separated list of ports, "
+      "wildcards are allowed (e.g. /dev/ttyUSB*). Use with --flash.",
+      "ports"));
+  cliOpts.append(QCommandLineOption(
+      "jobs", "Maximum number of devices flashed at the same time with "
+              "--ports.",
+      "number", "16"));
+  cliOpts.append(QCommandLineOption(
+      "events-fd",
+      "Write machine-readable flashing progress and timing events to the "
+      "given file descriptor, one JSON object per line.",
+      "fd"));
+  cliOpts.append(QCommandLineOption(
+      "daemon",
+      "Run as a daemon, accepting jobs as JSON on the given local socket.",
+      "socket"));
   cliOpts.append(
       QCommandLineOption("probe", "Check device presence on a given port."));
   cliOpts.append(QCommandLineOption(
       "get-mac", "Output MAC address of the device on a given port."));
   cliOpts.append(QCommandLineOption(
       "flash", "Flash firmware from the given file.", "file"));
+  cliOpts.append(QCommandLineOption(
+      "dump-flash", "Read entire flash of the device into the given file.",
+      "file"));
   cliOpts.append(QCommandLineOption(
       {"debug", "d"}, "Enable debug output. Equivalent to --V=4"));
 #if (QT_VERSION < QT_VERSION_CHECK(5, 4, 0))
@@ -0,0 +1,192 @@
+#include "batch_flasher.h"
+
+#include <atomic>
+#include <vector>
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QRegExp>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include "config.h"
+#include "flasher.h"
+#include "prompter.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+const int kDefaultMaxThreads = 16;
+
+// Nobody is there to answer, go with the default like the CLI does.
+class BatchPrompter : public Prompter {
+ public:
+  explicit BatchPrompter(const QString &port) : Prompter(nullptr), port_(port) {
+  }
+
+  int Prompt(QString text, QList<QPair<QString, ButtonRole>> buttons) override {
+    const int answer = defaultAnswer(buttons);
+    qWarning() << port_ << "prompt:" << text << "answering"
+               << buttons[answer].first;
+    return answer;
+  }
+
+ private:
+  const QString port_;
+};
+
+// State of one device, shared between its worker and the progress reporter.
+struct Device {
+  QString port;
+  std::atomic<bool> started{false};
+  std::atomic<bool> done{false};
+  std::atomic<qint64> bytesWritten{0};
+  std::atomic<qint64> totalBytes{0};
+  BatchFlasher::Result result;  // Written by the worker before done is set.
+};
+
+class DeviceJob : public QRunnable {
+ public:
+  DeviceJob(Device *d, BatchFlasher::HALFactory halFactory,
+            BatchFlasher::EventHandler eventHandler, const Config *config,
+            FirmwareBundle *fw)
+      : d_(d),
+        halFactory_(halFactory),
+        eventHandler_(eventHandler),
+        config_(config),
+        fw_(fw) {
+  }
+
+  void run() override {
+    QElapsedTimer timer;
+    timer.start();
+    d_->result.port = d_->port;
+    d_->started = true;
+    util::Status st = flash();
+    if (!st.ok()) {
+      d_->result.success = false;
+      d_->result.message = QString::fromStdString(st.ToString());
+    }
+    d_->result.elapsedMs = timer.elapsed();
+    qInfo() << d_->port << (d_->result.success ? "done" : "failed") << "in"
+            << d_->result.elapsedMs << "ms:" << d_->result.message;
+    d_->done = true;
+  }
+
+ private:
+  // Port, HAL and flasher are all created here, so that they belong to the
+  // pool thread.
+  util::Status flash() {
+    auto sp = connectTransport(d_->port, 115200);
+    if (!sp.ok()) return sp.status();
+    std::unique_ptr<Transport> port(sp.ValueOrDie());
+    std::unique_ptr<HAL> hal = halFactory_(port.get());
+    BatchPrompter prompter(d_->port);
+    std::unique_ptr<Flasher> f(hal->flasher(&prompter));
+    util::Status st = f->setOptionsFromConfig(*config_);
+    if (!st.ok()) return st;
+    st = f->setFirmware(fw_);
+    if (!st.ok()) return st;
+    d_->totalBytes = f->totalBytes();
+    // No context object, so these are called directly on this thread.
+    Device *d = d_;
+    QObject::connect(f.get(), &Flasher::progress,
+                     [d](int bytesWritten) { d->bytesWritten = bytesWritten; });
+    QObject::connect(f.get(), &Flasher::done, [d](QString msg, bool ok) {
+      d->result.success = ok;
+      d->result.message = msg;
+    });
+    if (eventHandler_) {
+      QObject::connect(
+          f.get(), &Flasher::progressEvent,
+          [this, d](const QJsonObject &e) { eventHandler_(d->port, e); });
+    }
+    f->run();
+    return util::Status::OK;
+  }
+
+  Device *d_;
+  const BatchFlasher::HALFactory halFactory_;
+  const BatchFlasher::EventHandler eventHandler_;
+  const Config *config_;
+  FirmwareBundle *fw_;
+};
+
+}  // namespace
+
+BatchFlasher::BatchFlasher(HALFactory halFactory, const Config *config,
+                           FirmwareBundle *fw)
+    : halFactory_(halFactory),
+      config_(config),
+      fw_(fw),
+      maxThreads_(kDefaultMaxThreads) {
+}
+
+void BatchFlasher::setMaxThreads(int maxThreads) {
+  maxThreads_ = maxThreads;
+}
+
+void BatchFlasher::setEventHandler(EventHandler handler) {
+  eventHandler_ = handler;
+}
+
+QList<BatchFlasher::Result> BatchFlasher::run(
+    const QStringList &ports, std::function<void(const Progress &)> onProgress,
+    int progressIntervalMs) {
+  std::vector<std::unique_ptr<Device>> devices;
+  QThreadPool pool;
+  pool.setMaxThreadCount(maxThreads_);
+  for (const QString &port : ports) {
+    devices.emplace_back(new Device);
+    devices.back()->port = port;
+    pool.start(new DeviceJob(devices.back().get(), halFactory_, eventHandler_,
+                             config_, fw_));
+  }
+
+  auto report = [&devices, &onProgress]() {
+    Progress p;
+    p.numDevices = devices.size();
+    for (const auto &d : devices) {
+      if (!d->started) continue;
+      p.bytesWritten += d->bytesWritten;
+      p.totalBytes += d->totalBytes;
+      if (d->done) {
+        p.numDone++;
+        if (!d->result.success) p.numFailed++;
+      }
+    }
+    onProgress(p);
+  };
+  while (!pool.waitForDone(progressIntervalMs)) report();
+  report();
+
+  QList<Result> results;
+  for (const auto &d : devices) results.append(d->result);
+  return results;
+}
+
+QStringList expandPortList(const QString &spec) {
+  QStringList ports;
+  for (const QString &entry : spec.split(',', QString::SkipEmptyParts)) {
+    const QString e = entry.trimmed();
+    if (!e.contains(QRegExp("[*?[]"))) {
+      ports.append(e);
+      continue;
+    }
+    const QFileInfo fi(e);
+    QDir dir(fi.path());
+    dir.setNameFilters(QStringList(fi.fileName()));
+    // Device nodes are neither files nor directories as far as QDir cares.
+    dir.setFilter(QDir::AllEntries | QDir::System | QDir::NoDotAndDotDot);
+    dir.setSorting(QDir::Name);
+    for (const QString &name : dir.entryList()) {
+      ports.append(dir.filePath(name));
+    }
+  }
+  return ports;
+}
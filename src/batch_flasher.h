@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_BATCH_FLASHER_H_
+#define CS_MFT_SRC_BATCH_FLASHER_H_
+
+#include <functional>
+#include <memory>
+
+#include <QJsonObject>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include "fw_bundle.h"
+#include "hal.h"
+#include "transport.h"
+
+class Config;
+
+// Flashes the same firmware onto a number of devices at once. Each device
+// gets its own port, HAL and Flasher, running on a pool thread. The bundle is
+// loaded once by the caller and shared by all of them: flashers only read
+// from it, and its data is implicitly shared, so nothing is copied or
+// decompressed again.
+class BatchFlasher {
+ public:
+  // Creates a HAL for the platform being flashed.
+  typedef std::function<std::unique_ptr<HAL>(Transport *port)> HALFactory;
+  // Receives Flasher::progressEvent()s of a device, on its pool thread.
+  typedef std::function<void(const QString &port, const QJsonObject &event)>
+      EventHandler;
+
+  struct Result {
+    QString port;
+    bool success = false;
+    QString message;
+    qint64 elapsedMs = 0;
+  };
+
+  struct Progress {
+    int numDevices = 0;
+    int numDone = 0;
+    int numFailed = 0;
+    qint64 bytesWritten = 0;
+    qint64 totalBytes = 0;  // Only counts devices that have started.
+  };
+
+  BatchFlasher(HALFactory halFactory, const Config *config, FirmwareBundle *fw);
+
+  // Maximum number of devices flashed at the same time.
+  void setMaxThreads(int maxThreads);
+  void setEventHandler(EventHandler handler);
+
+  // Flashes all the ports and returns the results, in the same order.
+  // Blocks until all devices are done. onProgress is called on the calling
+  // thread every progressIntervalMs and once more at the end.
+  QList<Result> run(const QStringList &ports,
+                    std::function<void(const Progress &)> onProgress,
+                    int progressIntervalMs = 250);
+
+ private:
+  HALFactory halFactory_;
+  EventHandler eventHandler_;
+  const Config *config_;
+  FirmwareBundle *fw_;
+  int maxThreads_;
+};
+
+// Expands a comma-separated list of ports. Entries with wildcards
+// (e.g. /dev/ttyUSB*) are replaced with the matching device files,
+// in alphabetical order.
+QStringList expandPortList(const QString &spec);
+
+#endif /* CS_MFT_SRC_BATCH_FLASHER_H_ */
@@ -16,8 +16,6 @@
 #include <QFile>
 #include <QMutex>
 #include <QMutexLocker>
-#include <QSerialPort>
-#include <QSerialPortInfo>
 #include <QThread>
 #ifndef NO_LIBFTDI
 #include <ftdi.h>
@@ -28,7 +26,6 @@
 
 #include "config.h"
 #include "fs.h"
-#include "serial.h"
 #include "status_qt.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
@@ -112,34 +109,23 @@ quint8 checksum(const QByteArray &bytes) {
   return r;
 }
 
-util::StatusOr<QByteArray> readBytes(QSerialPort *s, int n,
+util::StatusOr<QByteArray> readBytes(Transport *s, int n,
                                      int timeout = kDefaultTimeoutMs) {
   QByteArray r;
-  int i = 0;
-  char c = 0;
-  while (i < n) {
+  while (r.length() < n) {
     if (s->bytesAvailable() == 0 && !s->waitForReadyRead(timeout)) {
       qDebug() << "Read bytes:" << r.toHex();
       return util::Status(
           util::error::DEADLINE_EXCEEDED,
-          QString("Timeout on reading byte %1").arg(i).toStdString());
+          QString("Timeout on reading byte %1").arg(r.length()).toStdString());
     }
-    if (!s->getChar(&c)) {
-      qDebug() << "Read bytes:" << r.toHex();
-      return util::Status(util::error::UNKNOWN,
-                          QString("Error reading byte %1: %2")
-                              .arg(i)
-                              .arg(s->errorString())
-                              .toStdString());
-    }
-    r.append(c);
-    i++;
+    r.append(s->read(n - r.length()));
   }
   qDebug() << "Read bytes:" << r.toHex();
   return r;
 }
 
-util::Status writeBytes(QSerialPort *s, const QByteArray &bytes,
+util::Status writeBytes(Transport *s, const QByteArray &bytes,
                         int timeout = kDefaultTimeoutMs) {
   // qDebug() << "Writing bytes:" << bytes.toHex();
   if (!s->write(bytes)) {
@@ -155,7 +141,7 @@ util::Status writeBytes(QSerialPort *s, const QByteArray &bytes,
   return util::Status::OK;
 }
 
-util::Status recvAck(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
+util::Status recvAck(Transport *s, int timeout = kDefaultTimeoutMs) {
   auto r = readBytes(s, 2, timeout);
   if (!r.ok()) {
     return r.status();
@@ -169,11 +155,11 @@ util::Status recvAck(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
   return util::Status::OK;
 }
 
-util::Status sendAck(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
+util::Status sendAck(Transport *s, int timeout = kDefaultTimeoutMs) {
   return writeBytes(s, QByteArray("\x00\xCC", 2), timeout);
 }
 
-util::Status doBreak(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
+util::Status doBreak(Transport *s, int timeout = kDefaultTimeoutMs) {
   qInfo() << "Sending break...";
   s->clear();
   if (!s->setBreakEnabled(true)) {
@@ -192,7 +178,7 @@ util::Status doBreak(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
   return recvAck(s, timeout);
 }
 
-util::StatusOr<QByteArray> recvPacket(QSerialPort *s,
+util::StatusOr<QByteArray> recvPacket(Transport *s,
                                       int timeout = kDefaultTimeoutMs) {
   auto r = readBytes(s, 3, timeout);
   if (!r.ok()) {
@@ -219,7 +205,7 @@ util::StatusOr<QByteArray> recvPacket(QSerialPort *s,
   return payload.ValueOrDie();
 }
 
-util::Status sendPacket(QSerialPort *s, const QByteArray &bytes,
+util::Status sendPacket(Transport *s, const QByteArray &bytes,
                         int timeout = kDefaultTimeoutMs) {
   QByteArray header;
   QDataStream hs(&header, QIODevice::WriteOnly);
@@ -284,11 +270,11 @@ util::Status boot(ftdi_context *ctx) {
 #endif
 
 #ifndef NO_LIBFTDI
-util::Status connectToBootLoader(QSerialPort *port, ftdi_context *ctx) {
+util::Status connectToBootLoader(Transport *port, ftdi_context *ctx) {
 #else
-util::Status connectToBootLoader(QSerialPort *port) {
+util::Status connectToBootLoader(Transport *port) {
 #endif
-  util::Status st = setSpeed(port, kSerialSpeed);
+  util::Status st = port->setBaudRate(kSerialSpeed);
   if (!st.ok()) return st;
   int i = 1;
   do {
@@ -318,11 +304,11 @@ class FlasherImpl : public Flasher {
   Q_OBJECT
  public:
 #ifndef NO_LIBFTDI
-  FlasherImpl(QSerialPort *port, ftdi_context *ftdiCtx, Prompter *prompter)
+  FlasherImpl(Transport *port, ftdi_context *ftdiCtx, Prompter *prompter)
       : port_(port), ftdiCtx_(ftdiCtx), prompter_(prompter) {
   }
 #else
-  FlasherImpl(QSerialPort *port, Prompter *prompter)
+  FlasherImpl(Transport *port, Prompter *prompter)
       : port_(port), prompter_(prompter) {
   }
 #endif
@@ -500,6 +486,7 @@ class FlasherImpl : public Flasher {
       st = util::Status::OK;
     }
 
+    Phase connectPhase(this, "connect");
     do {
       while (!st.ok()) {
 #ifndef NO_LIBFTDI
@@ -508,28 +495,37 @@ class FlasherImpl : public Flasher {
         st = connectToBootLoader(port_);
 #endif
         if (!st.ok()) {
+          connectPhase.retry();
           qCritical() << st;
           QString msg = QString::fromUtf8(st.ToString().c_str());
           int answer = prompter_->Prompt(
               msg, {{tr("Retry"), Prompter::ButtonRole::No},
-                    {tr("Cancel"), Prompter::ButtonRole::Yes}});
+                    {tr("Cancel"), Prompter::ButtonRole::Reject}});
           if (answer == 1) return st;
         }
       }
       emit statusMessage(tr("Updating bootloader..."), true);
+      Phase bootloader(this, "bootloader");
       st = switchToNWPBootloader();
+      bootloader.end(st.ok());
+      if (!st.ok()) connectPhase.retry();
     } while (!st.ok());
+    connectPhase.end(true);
 
     if (failfs_size_ > 0) {
+      Phase format(this, "format");
       st = formatFailFS(failfs_size_);
+      format.end(st.ok());
       if (!st.ok()) {
         return st;
       }
     }
 
+    Phase write(this, "write");
     for (const QString &f : files_.keys()) {
       st = uploadFile(files_[f]);
       if (!st.ok()) return st;
+      write.addBytes(files_[f].data.length());
     }
 
     if (spiffs_image_.length() > 0) {
@@ -538,11 +534,15 @@ class FlasherImpl : public Flasher {
       if (!st.ok()) {
         return st;
       }
+      write.addBytes(spiffs_image_.length());
     }
+    write.end(true);
 #ifndef NO_LIBFTDI
     if (ftdiCtx_ != nullptr) {
       emit statusMessage(tr("Rebooting into firmware..."), true);
+      Phase bootPhase(this, "boot");
       st = boot(ftdiCtx_);
+      bootPhase.end(st.ok());
       if (!st.ok()) return st;
     } else
 #endif
@@ -1032,7 +1032,7 @@ class FlasherImpl : public Flasher {
 
   mutable QMutex lock_;
 
-  QSerialPort *port_;
+  Transport *port_;
 #ifndef NO_LIBFTDI
   ftdi_context *ftdiCtx_;
 #endif
@@ -1060,7 +1060,7 @@ QString FlasherImpl::SLFSFileInfo::toString() const {
 #ifndef NO_LIBFTDI
 class CC3200HAL : public HAL {
  public:
-  CC3200HAL(QSerialPort *port) : port_(port), ftdiCtx_(ftdi_new(), ftdi_free) {
+  CC3200HAL(Transport *port) : port_(port), ftdiCtx_(ftdi_new(), ftdi_free) {
     auto ftdi = openFTDI();
     if (ftdi.ok()) {
       ftdiCtx_.reset(ftdi.MoveValueOrDie());
@@ -1093,14 +1093,22 @@ class CC3200HAL : public HAL {
     return boot(ftdiCtx_.get());
   }
 
+  util::Status dumpFlash(const Config &config,
+                         const QString &fileName) const override {
+    Q_UNUSED(config);
+    Q_UNUSED(fileName);
+    return util::Status(util::error::UNIMPLEMENTED,
+                        "Dumping CC3200 flash is not supported");
+  }
+
  private:
-  QSerialPort *port_;
+  Transport *port_;
   std::unique_ptr<ftdi_context, void (*)(ftdi_context *) > ftdiCtx_;
 };
 #else   // NO_LIBFTDI
 class CC3200HAL : public HAL {
  public:
-  CC3200HAL(QSerialPort *port) : port_(port) {
+  CC3200HAL(Transport *port) : port_(port) {
   }
 
   util::Status probe() const override {
@@ -1126,14 +1134,22 @@ class CC3200HAL : public HAL {
                         "Rebooting CC3200 is not supported");
   }
 
+  util::Status dumpFlash(const Config &config,
+                         const QString &fileName) const override {
+    Q_UNUSED(config);
+    Q_UNUSED(fileName);
+    return util::Status(util::error::UNIMPLEMENTED,
+                        "Dumping CC3200 flash is not supported");
+  }
+
  private:
-  QSerialPort *port_;
+  Transport *port_;
 };
 #endif  // NO_LIBFTDI
 
 }  // namespace
 
-std::unique_ptr<::HAL> HAL(QSerialPort *port) {
+std::unique_ptr<::HAL> HAL(Transport *port) {
   return std::move(std::unique_ptr<::HAL>(new CC3200HAL(port)));
 }
 
@@ -8,15 +8,15 @@
 
 #include <memory>
 
-#include <QSerialPort>
 
 #include "hal.h"
+#include "transport.h"
 
 class Config;
 
 namespace CC3200 {
 
-std::unique_ptr<HAL> HAL(QSerialPort *port);
+std::unique_ptr<HAL> HAL(Transport *port);
 
 void addOptions(Config *config);
 
@@ -3,6 +3,8 @@
 #include <fcntl.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
 #include <memory>
 
@@ -10,19 +12,19 @@
 #include <QCoreApplication>
 #include <QFile>
 #include <QFileInfo>
+#include <QJsonDocument>
 #include <QSocketNotifier>
 #include <QTimer>
-#include <QSerialPort>
-#include <QSerialPortInfo>
 
 #include <common/util/error_codes.h>
 
+#include "batch_flasher.h"
 #include "cc3200.h"
 #include "config.h"
 #include "esp8266.h"
 #include "prompter.h"
-#include "serial.h"
 #include "status_qt.h"
+#include "transport.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
 #define qInfo qWarning
@@ -39,10 +41,11 @@ class CLIPrompterImpl : public Prompter {
   }
 
   int Prompt(QString text, QList<QPair<QString, ButtonRole>> buttons) override {
+    const int answer = defaultAnswer(buttons);
     cout << "Prompt: " << text.toStdString() << endl;
     cout << "CLI prompting not implemented, returning default ("
-         << buttons[0].first.toStdString() << ")" << endl;
-    return 0;
+         << buttons[answer].first.toStdString() << ")" << endl;
+    return answer;
   }
 };
 
@@ -61,7 +64,28 @@ CLI::CLI(Config *config, QCommandLineParser *parser, QObject *parent)
 void CLI::run() {
   int exit_code = 0;
 
-  std::unique_ptr<QSerialPort> port;
+  if (parser_->isSet("events-fd")) {
+    bool ok = false;
+    const int fd = parser_->value("events-fd").toInt(&ok);
+    events_.reset(new QFile());
+    if (!ok || !events_->open(fd, QIODevice::WriteOnly)) {
+      qCritical() << "Failed to open event stream"
+                  << parser_->value("events-fd") << events_->errorString();
+      qApp->exit(1);
+      return;
+    }
+  }
+
+  if (parser_->isSet("daemon")) {
+    daemon_.reset(new Daemon(config_));
+    util::Status st = daemon_->listen(parser_->value("daemon"));
+    if (!st.ok()) {
+      qCritical() << st;
+      qApp->exit(1);
+    }
+    return;
+  }
+
   if (parser_->isSet("port")) {
     QString portName = parser_->value("port");
 #ifdef __unix__
@@ -73,13 +97,7 @@ void CLI::run() {
       portName = qf.canonicalFilePath();
     }
 #endif
-    const auto qspi = findSerial(portName);
-    if (!qspi.ok()) {
-      qCritical() << qspi.status();
-      qApp->exit(1);
-      return;
-    }
-    auto sp = connectSerial(qspi.ValueOrDie(), 115200);
+    auto sp = connectTransport(portName, 115200);
     if (!sp.ok()) {
       qCritical() << "Error opening " << portName << ": " << sp.status();
       qApp->exit(1);
@@ -112,6 +130,10 @@ void CLI::run() {
     if (r.ok()) {
       cout << smac.ValueOrDie().toStdString() << endl;
     }
+  } else if (parser_->isSet("dump-flash")) {
+    r = hal_->dumpFlash(*config_, parser_->value("dump-flash"));
+  } else if (parser_->isSet("flash") && parser_->isSet("ports")) {
+    r = flashBatch(parser_->value("flash"), parser_->value("ports"));
   } else if (parser_->isSet("flash")) {
     r = flash(parser_->value("flash"));
     if (r.ok() && parser_->isSet("console")) {
@@ -185,6 +207,9 @@ util::Status CLI::flash(const QString &path) {
     prev = important;
   });
 
+  connect(f.get(), &Flasher::progressEvent,
+          [this](const QJsonObject &e) { writeEvent(e); });
+
   f->run();  // connected slots should be called inline, so we don't need to
              // unblock the event loop for to print progress on terminal.
 
@@ -196,10 +221,86 @@ util::Status CLI::flash(const QString &path) {
   return util::Status::OK;
 }
 
+util::Status CLI::flashBatch(const QString &path, const QString &portList) {
+  const QString platform = parser_->value("platform");
+  bool ok = false;
+  const int jobs = parser_->value("jobs").toInt(&ok);
+  if (!ok || jobs <= 0) {
+    return QS(util::error::INVALID_ARGUMENT,
+              tr("Invalid number of jobs: %1").arg(parser_->value("jobs")));
+  }
+  const QStringList ports = expandPortList(portList);
+  if (ports.isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT,
+              tr("No ports match %1").arg(portList));
+  }
+
+  // Loaded and verified once for all the devices.
+  auto fwbs = NewZipFWBundle(path);
+  if (!fwbs.ok()) {
+    return QSP("failed to load firmware bundle", fwbs.status());
+  }
+  FirmwareBundle *fwb = fwbs.ValueOrDie().get();
+
+  qInfo() << "Flashing" << fwb->name() << fwb->platform().toUpper()
+          << fwb->buildId() << "onto" << ports.size() << "devices";
+
+  BatchFlasher bf(
+      [platform](Transport *port) {
+        return platform == "esp8266" ? ESP8266::HAL(port) : CC3200::HAL(port);
+      },
+      config_, fwb);
+  bf.setMaxThreads(jobs);
+  bf.setEventHandler([this](const QString &port, const QJsonObject &e) {
+    QJsonObject pe(e);
+    pe["port"] = port;
+    writeEvent(pe);
+  });
+  const auto results =
+      bf.run(ports, [](const BatchFlasher::Progress &p) {
+        const int percent =
+            p.totalBytes > 0 ? p.bytesWritten * 100 / p.totalBytes : 0;
+        cout << "\r" << p.numDone << "/" << p.numDevices << " done, "
+             << p.numFailed << " failed, " << percent << "%" << std::flush;
+      });
+  cout << endl;
+
+  int portWidth = 4;
+  for (const auto &res : results) {
+    portWidth = std::max(portWidth, res.port.length());
+  }
+  cout << std::left << std::setw(portWidth) << "Port"
+       << "  Result  Time, s  Message" << endl;
+  int numFailed = 0;
+  for (const auto &res : results) {
+    if (!res.success) numFailed++;
+    cout << std::left << std::setw(portWidth) << res.port.toStdString() << "  "
+         << std::setw(6) << (res.success ? "OK" : "FAILED") << "  "
+         << std::right << std::setw(7) << std::fixed << std::setprecision(1)
+         << res.elapsedMs / 1000.0 << "  "
+         << res.message.simplified().toStdString() << endl;
+  }
+
+  if (numFailed > 0) {
+    return QS(util::error::ABORTED, tr("Flashing failed on %1 of %2 devices.")
+                                        .arg(numFailed)
+                                        .arg(results.size()));
+  }
+  return util::Status::OK;
+}
+
+void CLI::writeEvent(const QJsonObject &event) {
+  if (events_ == nullptr) return;
+  QMutexLocker lock(&eventsLock_);
+  events_->write(QJsonDocument(event).toJson(QJsonDocument::Compact) + "\n");
+  events_->flush();
+}
+
 #ifndef _WIN32
 util::Status CLI::console() {
-  QSerialPort *port = port_.get();
-  util::Status st = setSpeed(port, config_->value("console-baud-rate").toInt());
+  Transport *port = port_.get();
+  util::Status st =
+      port->setBaudRate(config_->value("console-baud-rate").toInt());
   if (!st.ok()) return st;
 
   QFile *cin = new QFile();
@@ -219,7 +320,7 @@ util::Status CLI::console() {
   QSocketNotifier *qsn =
       new QSocketNotifier(fileno(stdin), QSocketNotifier::Read, this);
   fcntl(0, F_SETFL, fcntl(0, F_GETFL, 0) | O_NONBLOCK);
-  connect(port_.get(), &QIODevice::readyRead, [port, cout, console_log]() {
+  connect(port_.get(), &Transport::readyRead, [port, cout, console_log]() {
     QByteArray data = port->readAll();
     if (console_log != nullptr) {
       for (int i = 0; i < data.length(); i++) {
@@ -8,14 +8,18 @@
 
 #include <memory>
 
+#include <QFile>
+#include <QJsonObject>
+#include <QMutex>
 #include <QObject>
-#include <QSerialPort>
 #include <QString>
 
 #include <common/util/status.h>
 
+#include "daemon.h"
 #include "hal.h"
 #include "prompter.h"
+#include "transport.h"
 
 class Config;
 class QCommandLineParser;
@@ -28,15 +32,22 @@ class CLI : public QObject {
 
  private:
   util::Status flash(const QString &path);
+  util::Status flashBatch(const QString &path, const QString &portList);
   util::Status console();
   util::Status generateID(const QString &filename, const QString &domain);
   void run();
+  // Writes a Flasher::progressEvent to the --events-fd stream, if any.
+  // Can be called from any thread.
+  void writeEvent(const QJsonObject &event);
 
   Config *config_;
   QCommandLineParser *parser_;
+  std::unique_ptr<Daemon> daemon_;
   std::unique_ptr<HAL> hal_;
-  std::unique_ptr<QSerialPort> port_;
+  std::unique_ptr<Transport> port_;
   Prompter *prompter_;
+  std::unique_ptr<QFile> events_;
+  QMutex eventsLock_;
 };
 
 #endif /* CS_MFT_SRC_CLI_H_ */
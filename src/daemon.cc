@@ -0,0 +1,304 @@
+#include "daemon.h"
+
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMetaObject>
+#include <QRunnable>
+
+#include <common/util/error_codes.h>
+
+#include "cc3200.h"
+#include "config.h"
+#include "esp8266.h"
+#include "flasher.h"
+#include "hal.h"
+#include "prompter.h"
+#include "status_qt.h"
+#include "transport.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+const int kMaxJobs = 32;
+
+QString statusMessage(const util::Status &st) {
+  return QString::fromStdString(st.error_message());
+}
+
+// Delivers job events to the client on the daemon's thread.
+class EventSink {
+ public:
+  EventSink(Daemon *daemon, int connId, const QJsonValue &id)
+      : daemon_(daemon), connId_(connId), id_(id) {
+  }
+
+  void send(const QString &type, QJsonObject event) const {
+    event["id"] = id_;
+    event["event"] = type;
+    QMetaObject::invokeMethod(daemon_, "sendEvent", Qt::QueuedConnection,
+                              Q_ARG(int, connId_), Q_ARG(QJsonObject, event));
+  }
+
+ private:
+  Daemon *daemon_;
+  const int connId_;
+  const QJsonValue id_;
+};
+
+// There is nobody to ask, tell the client and go with the default.
+class DaemonPrompter : public Prompter {
+ public:
+  explicit DaemonPrompter(const EventSink *events)
+      : Prompter(nullptr), events_(events) {
+  }
+
+  int Prompt(QString text, QList<QPair<QString, ButtonRole>> buttons) override {
+    const int answer = defaultAnswer(buttons);
+    events_->send("prompt",
+                  {{"message", text}, {"answer", buttons[answer].first}});
+    return answer;
+  }
+
+ private:
+  const EventSink *events_;
+};
+
+class DaemonJob : public QRunnable {
+ public:
+  DaemonJob(Daemon *daemon, int connId, const QJsonObject &req,
+            const Config &config)
+      : daemon_(daemon),
+        events_(daemon, connId, req.value("id")),
+        op_(req.value("op").toString()),
+        platform_(req.value("platform").toString()),
+        port_(req.value("port").toString()),
+        firmware_(req.value("firmware").toString()),
+        file_(req.value("file").toString()),
+        config_(config) {
+    const QJsonObject opts = req.value("options").toObject();
+    for (auto it = opts.begin(); it != opts.end(); ++it) {
+      config_.setValue(it.key(), it.value().toVariant().toString(),
+                       Config::Level::Flags);
+    }
+  }
+
+  void run() override {
+    QJsonObject result;
+    util::Status st = execute(&result);
+    result["ok"] = st.ok();
+    if (!st.ok()) result["message"] = statusMessage(st);
+    qInfo() << op_ << port_ << "done:" << st;
+    events_.send("done", result);
+    QMetaObject::invokeMethod(daemon_, "jobDone", Qt::QueuedConnection,
+                              Q_ARG(QString, port_));
+  }
+
+ private:
+  // Port and everything using it are created and destroyed on the pool
+  // thread.
+  util::Status execute(QJsonObject *result) {
+    auto sp = connectTransport(port_, 115200);
+    if (!sp.ok()) return sp.status();
+    std::unique_ptr<Transport> port(sp.ValueOrDie());
+    std::unique_ptr<HAL> hal = platform_ == "esp8266"
+                                   ? ESP8266::HAL(port.get())
+                                   : CC3200::HAL(port.get());
+    if (op_ == "probe") {
+      return hal->probe();
+    } else if (op_ == "get-mac") {
+      auto mac = hal->getMAC();
+      if (!mac.ok()) return mac.status();
+      (*result)["mac"] = mac.ValueOrDie();
+      return util::Status::OK;
+    } else if (op_ == "dump-flash") {
+      return hal->dumpFlash(config_, file_);
+    }
+    return flash(hal.get(), result);
+  }
+
+  util::Status flash(HAL *hal, QJsonObject *result) {
+    auto fwr = daemon_->bundle(firmware_);
+    if (!fwr.ok()) return QSP("failed to load firmware bundle", fwr.status());
+    std::shared_ptr<FirmwareBundle> fw = fwr.ValueOrDie();
+    DaemonPrompter prompter(&events_);
+    std::unique_ptr<Flasher> f(hal->flasher(&prompter));
+    util::Status st = f->setOptionsFromConfig(config_);
+    if (!st.ok()) return st;
+    st = f->setFirmware(fw.get());
+    if (!st.ok()) return st;
+
+    // No context object, so these are called directly on this thread.
+    const EventSink *events = &events_;
+    const int total = f->totalBytes();
+    QObject::connect(f.get(), &Flasher::progress, [events, total](int bytes) {
+      events->send("progress", {{"bytes", bytes}, {"total", total}});
+    });
+    QObject::connect(f.get(), &Flasher::progressEvent,
+                     [events](const QJsonObject &e) {
+                       events->send(e["event"].toString(), e);
+                     });
+    QObject::connect(f.get(), &Flasher::statusMessage,
+                     [events](QString msg, bool important) {
+                       events->send("status", {{"message", msg},
+                                               {"important", important}});
+                     });
+    bool success = false;
+    QObject::connect(f.get(), &Flasher::done,
+                     [result, &success](QString msg, bool ok) {
+                       (*result)["message"] = msg;
+                       success = ok;
+                     });
+    f->run();
+    if (!success) {
+      return QS(util::error::ABORTED, (*result)["message"].toString());
+    }
+    return util::Status::OK;
+  }
+
+  Daemon *daemon_;
+  const EventSink events_;
+  const QString op_;
+  const QString platform_;
+  const QString port_;
+  const QString firmware_;
+  const QString file_;
+  Config config_;  // Daemon's config with the job's options applied.
+};
+
+}  // namespace
+
+Daemon::Daemon(const Config *config, QObject *parent)
+    : QObject(parent), config_(config), server_(new QLocalServer(this)) {
+  pool_.setMaxThreadCount(kMaxJobs);
+  connect(server_, &QLocalServer::newConnection, this, &Daemon::newConnection);
+}
+
+Daemon::~Daemon() {
+  pool_.waitForDone();
+}
+
+util::Status Daemon::listen(const QString &name) {
+  // Socket file may have been left behind by a daemon that did not exit
+  // cleanly.
+  QLocalServer::removeServer(name);
+  if (!server_->listen(name)) {
+    return QS(util::error::UNAVAILABLE, tr("Failed to listen on %1: %2")
+                                            .arg(name)
+                                            .arg(server_->errorString()));
+  }
+  qInfo() << "Listening on" << server_->fullServerName();
+  return util::Status::OK;
+}
+
+util::StatusOr<std::shared_ptr<FirmwareBundle>> Daemon::bundle(
+    const QString &path) {
+  const QFileInfo fi(path);
+  const QString key = fi.absoluteFilePath();
+  QMutexLocker lock(&bundlesLock_);
+  auto it = bundles_.find(key);
+  if (it != bundles_.end() && it->modified == fi.lastModified() &&
+      it->size == fi.size()) {
+    return it->fw;
+  }
+  auto fwbs = NewZipFWBundle(key);
+  if (!fwbs.ok()) return fwbs.status();
+  // Jobs that are still using the old bundle keep it alive.
+  std::shared_ptr<FirmwareBundle> fw(fwbs.ValueOrDie().release());
+  bundles_[key] = {fi.lastModified(), fi.size(), fw};
+  qInfo() << "Loaded" << key << fw->name() << fw->buildId();
+  return fw;
+}
+
+void Daemon::newConnection() {
+  while (QLocalSocket *conn = server_->nextPendingConnection()) {
+    const int connId = nextConnId_++;
+    conns_[connId] = conn;
+    connect(conn, &QLocalSocket::readyRead,
+            [this, connId]() { readRequests(connId); });
+    connect(conn, &QLocalSocket::disconnected, [this, connId, conn]() {
+      // Jobs keep running, their events are dropped.
+      conns_.remove(connId);
+      conn->deleteLater();
+    });
+  }
+}
+
+void Daemon::readRequests(int connId) {
+  QLocalSocket *conn = conns_.value(connId);
+  if (conn == nullptr) return;
+  while (conn->canReadLine()) {
+    const QByteArray line = conn->readLine().trimmed();
+    if (line.isEmpty()) continue;
+    QJsonParseError err;
+    const QJsonDocument doc = QJsonDocument::fromJson(line, &err);
+    const QJsonObject req = doc.object();
+    util::Status st;
+    if (!doc.isObject()) {
+      st = QS(util::error::INVALID_ARGUMENT,
+              tr("Invalid request: %1").arg(err.errorString()));
+    } else {
+      st = startJob(connId, req);
+    }
+    if (!st.ok()) {
+      sendEvent(connId, {{"id", req.value("id")},
+                         {"event", "done"},
+                         {"ok", false},
+                         {"message", statusMessage(st)}});
+    }
+  }
+}
+
+util::Status Daemon::startJob(int connId, const QJsonObject &req) {
+  const QString op = req.value("op").toString();
+  const QString platform = req.value("platform").toString();
+  QString port = req.value("port").toString();
+  if (op != "flash" && op != "probe" && op != "get-mac" &&
+      op != "dump-flash") {
+    return QS(util::error::INVALID_ARGUMENT, tr("Unknown op: %1").arg(op));
+  }
+  if (platform != "esp8266" && platform != "cc3200") {
+    return QS(util::error::INVALID_ARGUMENT,
+              tr("Unknown platform: %1").arg(platform));
+  }
+  if (port.isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT, tr("No port specified"));
+  }
+  if (op == "flash" && req.value("firmware").toString().isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT, tr("No firmware specified"));
+  }
+  if (op == "dump-flash" && req.value("file").toString().isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT, tr("No file specified"));
+  }
+#ifdef __unix__
+  // Same device may be referred to by different names, e.g. a
+  // /dev/serial/by-id/ link and the node it points to.
+  const QString canonicalPort = QFileInfo(port).canonicalFilePath();
+  if (!canonicalPort.isEmpty()) port = canonicalPort;
+#endif
+  if (busyPorts_.contains(port)) {
+    return QS(util::error::FAILED_PRECONDITION,
+              tr("Port %1 is busy").arg(port));
+  }
+  qInfo() << "Starting" << op << "on" << port;
+  busyPorts_.insert(port);
+  QJsonObject job(req);
+  job["port"] = port;
+  pool_.start(new DaemonJob(this, connId, job, *config_));
+  return util::Status::OK;
+}
+
+void Daemon::sendEvent(int connId, const QJsonObject &event) {
+  QLocalSocket *conn = conns_.value(connId);
+  if (conn == nullptr) return;
+  conn->write(QJsonDocument(event).toJson(QJsonDocument::Compact));
+  conn->write("\n");
+}
+
+void Daemon::jobDone(const QString &port) {
+  busyPorts_.remove(port);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_DAEMON_H_
+#define CS_MFT_SRC_DAEMON_H_
+
+#include <memory>
+
+#include <QDateTime>
+#include <QJsonObject>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+#include <common/util/statusor.h>
+
+#include "fw_bundle.h"
+
+class Config;
+class QLocalServer;
+class QLocalSocket;
+
+// Runs jobs submitted over a local socket, so that a fixture controller can
+// drive many devices without starting a new process for each one. Firmware
+// bundles stay loaded between jobs.
+//
+// Clients send requests as JSON objects, one per line:
+//   {"id": 1, "op": "flash", "platform": "esp8266", "port": "/dev/ttyUSB0",
+//    "firmware": "/path/to/fw.zip", "options": {"flash-baud-rate": 921600}}
+// op is one of flash, probe, get-mac or dump-flash ("file" is the output).
+// options override the daemon's own flags for this job only.
+//
+// Daemon replies with events, also one per line and carrying the id of the
+// request: "status" (message, important), "progress" (bytes, total), "prompt"
+// (message, answer) and finally "done" (ok, message and, for get-mac, mac).
+// Jobs on different ports run in parallel.
+class Daemon : public QObject {
+  Q_OBJECT
+
+ public:
+  Daemon(const Config *config, QObject *parent = nullptr);
+  ~Daemon();
+
+  // Starts accepting connections on a local socket with the given name
+  // (a path on Unix).
+  util::Status listen(const QString &name);
+
+  // Returns the bundle from the cache, loading it if it is not there or the
+  // file has changed. Thread-safe.
+  util::StatusOr<std::shared_ptr<FirmwareBundle>> bundle(const QString &path);
+
+ public slots:
+  // Sends an event to a client. Called on the daemon's thread, jobs queue
+  // calls to it.
+  void sendEvent(int connId, const QJsonObject &event);
+  void jobDone(const QString &port);
+
+ private:
+  void newConnection();
+  void readRequests(int connId);
+  util::Status startJob(int connId, const QJsonObject &req);
+
+  struct CachedBundle {
+    QDateTime modified;
+    qint64 size;
+    std::shared_ptr<FirmwareBundle> fw;
+  };
+
+  const Config *config_;
+  QLocalServer *server_;  // Owned by this
+  QMap<int, QLocalSocket *> conns_;
+  int nextConnId_ = 1;
+  QSet<QString> busyPorts_;
+  QThreadPool pool_;
+
+  QMutex bundlesLock_;  // Held while loading a bundle.
+  QMap<QString, CachedBundle> bundles_;
+};
+
+#endif /* CS_MFT_SRC_DAEMON_H_ */
@@ -36,6 +36,7 @@
 #include "log_viewer.h"
 #include "serial.h"
 #include "status_qt.h"
+#include "transport.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
 #define qInfo qWarning
@@ -622,9 +623,9 @@ void MainDialog::setStatusMessage(MsgType level, const QString &msg) {
 void MainDialog::createHAL() {
   const QString platform = ui_.platformSelector->currentText();
   if (platform == "ESP8266") {
-    hal_ = ESP8266::HAL(serial_port_.get());
+    hal_ = ESP8266::HAL(SerialTransport::forPort(serial_port_.get()));
   } else if (platform == "CC3200") {
-    hal_ = CC3200::HAL(serial_port_.get());
+    hal_ = CC3200::HAL(SerialTransport::forPort(serial_port_.get()));
   } else {
     qFatal("Unknown platform: %s", platform.toStdString().c_str());
   }
@@ -1,6 +1,8 @@
 #include "esp8266.h"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <memory>
 #include <string>
@@ -13,8 +15,7 @@
 #include <QIODevice>
 #include <QMutex>
 #include <QMutexLocker>
-#include <QSerialPort>
-#include <QSerialPortInfo>
+#include <QSettings>
 #include <QStringList>
 #include <QTextStream>
 #include <QThread>
@@ -23,11 +24,15 @@
 #include <common/util/statusor.h>
 
 #include "config.h"
+#include "esp_digest_cache.h"
 #include "esp_flasher_client.h"
 #include "esp_rom_client.h"
 #include "fs.h"
-#include "serial.h"
 #include "status_qt.h"
+#include "transport.h"
+
+#define MINIZ_HEADER_FILE_ONLY
+#include "common/miniz.c"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
 #define qInfo qWarning
@@ -46,8 +51,18 @@ const char kDefaultSPIFFSOffset[] = "0xec000";
 const char kSPIFFSSizeOption[] = "esp8266-spiffs-size";
 const char kDefaultSPIFFSSize[] = "65536";
 const char kNoMinimizeWritesOption[] = "esp8266-no-minimize-writes";
+const char kNoCompressWritesOption[] = "esp8266-no-compress-writes";
+const char kNoBlankCheckOption[] = "esp8266-no-blank-check";
+const char kKeepStubOption[] = "esp8266-keep-stub";
+const char kAutoBaudRateOption[] = "esp8266-auto-baud-rate";
 
 const int kDefaultROMBaudRate = 115200;
+
+// Write planner cost model, in milliseconds. Typical values for common chips.
+const double kSectorEraseCostMs = 45;
+const double kBlockEraseCostMs = 350;
+// Command round trips, digest, etc.
+const double kWriteCmdCostMs = 20;
 const int kDefaultFlashBaudRate = 230400;
 /* Last 16K of flash are reserved for system params. */
 const quint32 kSystemParamsAreaSize = 16 * 1024;
@@ -61,10 +76,28 @@ const char kSystemParamsPartType[] = "sys_params";
   "(GPIO0 = 0, reset) manually and "                             \
   "retry now."
 
+util::StatusOr<quint32> flashSizeFromChipID(quint32 chipID) {
+  quint32 mfg = (chipID & 0xff000000) >> 24;
+  quint32 type = (chipID & 0x00ff0000) >> 16;
+  quint32 capacity = (chipID & 0x0000ff00) >> 8;
+  qInfo() << "Flash chip ID:" << hex << showbase << mfg << type << capacity;
+  if (mfg != 0 && capacity >= 0x13 && capacity < 0x20) {
+    // Capacity is the power of two.
+    return 1 << capacity;
+  }
+  return QS(util::error::INTERNAL, QObject::tr("unknown flash chip"));
+}
+
+util::StatusOr<quint32> detectFlashSize(ESPFlasherClient *fc) {
+  auto flashChipIDRes = fc->getFlashChipID();
+  if (!flashChipIDRes.ok()) return flashChipIDRes.status();
+  return flashSizeFromChipID(flashChipIDRes.ValueOrDie());
+}
+
 class FlasherImpl : public Flasher {
   Q_OBJECT
  public:
-  FlasherImpl(QSerialPort *port, Prompter *prompter)
+  FlasherImpl(Transport *port, Prompter *prompter)
       : port_(port), prompter_(prompter) {
   }
 
@@ -146,6 +179,34 @@ class FlasherImpl : public Flasher {
       }
       minimize_writes_ = !value.toBool();
       return util::Status::OK;
+    } else if (name == kNoCompressWritesOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      compress_writes_ = !value.toBool();
+      return util::Status::OK;
+    } else if (name == kNoBlankCheckOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      skip_blank_erase_ = !value.toBool();
+      return util::Status::OK;
+    } else if (name == kKeepStubOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      keep_stub_ = value.toBool();
+      return util::Status::OK;
+    } else if (name == kAutoBaudRateOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      auto_baud_rate_ = value.toBool();
+      return util::Status::OK;
     } else {
       return util::Status(util::error::INVALID_ARGUMENT, "unknown option");
     }
@@ -154,8 +215,10 @@ class FlasherImpl : public Flasher {
   util::Status setOptionsFromConfig(const Config &config) override {
     util::Status r;
 
-    QStringList boolOpts(
-        {kMergeFSOption, kNoMinimizeWritesOption, kFlashEraseChipOption});
+    QStringList boolOpts({kMergeFSOption, kNoMinimizeWritesOption,
+                          kNoCompressWritesOption, kNoBlankCheckOption,
+                          kKeepStubOption, kAutoBaudRateOption,
+                          kFlashEraseChipOption});
     for (const auto &opt : boolOpts) {
       auto s = setOption(opt, config.boolValue(opt));
       if (!s.ok()) {
@@ -217,8 +280,14 @@ class FlasherImpl : public Flasher {
       if (!data.ok()) return data.status();
       qInfo() << p.name << ":" << data.ValueOrDie().length() << "@" << hex
               << showbase << addr;
-      images_[addr] = {
-          .addr = addr, .data = data.ValueOrDie(), .attrs = p.attrs};
+      // If the bundle has the part compressed, keep the stream. It will be
+      // sent as is, unless the image gets modified before writing.
+      const auto deflated = fw->getPartDeflatedSource(p.name);
+      images_[addr] = {.addr = addr,
+                       .data = data.ValueOrDie(),
+                       .deflated = deflated.ok() ? deflated.ValueOrDie()
+                                                 : QByteArray(),
+                       .attrs = p.attrs};
     }
     return util::Status::OK;
   }
@@ -236,35 +305,19 @@ class FlasherImpl : public Flasher {
     return r;
   }
 
-  util::StatusOr<std::unique_ptr<QSerialPort>> getFlashingDataPort() {
-    std::unique_ptr<QSerialPort> second_port;
+  util::StatusOr<std::unique_ptr<Transport>> getFlashingDataPort() {
+    std::unique_ptr<Transport> second_port;
     if (!flashing_port_name_.isEmpty()) {
-      const auto &ports = QSerialPortInfo::availablePorts();
-      QSerialPortInfo info;
-      bool found = false;
-      for (const auto &port : ports) {
-        if (port.systemLocation() != flashing_port_name_) {
-          continue;
-        }
-        info = port;
-        found = true;
-        break;
-      }
-      if (!found) {
-        return util::Status(
-            util::error::NOT_FOUND,
-            tr("Port %1 not found").arg(flashing_port_name_).toStdString());
-      }
-      auto serial = connectSerial(info, kDefaultROMBaudRate);
-      if (!serial.ok()) {
+      auto t = connectTransport(flashing_port_name_, kDefaultROMBaudRate);
+      if (!t.ok()) {
         return util::Status(
             util::error::UNKNOWN,
             tr("Failed to open %1: %2")
                 .arg(flashing_port_name_)
-                .arg(QString::fromStdString(serial.status().ToString()))
+                .arg(QString::fromStdString(t.status().ToString()))
                 .toStdString());
       }
-      second_port.reset(serial.ValueOrDie());
+      second_port.reset(t.ValueOrDie());
     }
 
     return std::move(second_port);
@@ -285,6 +338,9 @@ class FlasherImpl : public Flasher {
   struct Image {
     ulong addr;
     QByteArray data;
+    // Raw deflate stream of data, if available. Must be cleared if data is
+    // modified.
+    QByteArray deflated;
     QMap<QString, QVariant> attrs;
   };
 
@@ -302,55 +358,44 @@ class FlasherImpl : public Flasher {
 
     ESPROMClient rom(port_,
                      fdps.ValueOrDie().get() ? fdps.ValueOrDie().get() : port_);
-
-    emit statusMessage("Connecting to ROM...", true);
-
-    util::Status st;
-    while (true) {
-      st = rom.connect();
-      if (st.ok()) break;
-      qCritical() << st;
-      QString msg = tr(FLASHING_MSG "\n\nError: %1")
-                        .arg(QString::fromUtf8(st.ToString().c_str()));
-      int answer =
-          prompter_->Prompt(msg, {{tr("Retry"), Prompter::ButtonRole::No},
-                                  {tr("Cancel"), Prompter::ButtonRole::Yes}});
-      if (answer == 1) {
-        return util::Status(util::error::UNAVAILABLE,
-                            "Failed to talk to bootloader.");
-      }
-    }
-
-    emit statusMessage(tr("Running flasher @ %1...").arg(flashing_speed_),
-                       true);
-
     ESPFlasherClient flasher_client(&rom);
 
-    st = flasher_client.connect(flashing_speed_);
-    if (!st.ok()) {
-      return QSP("Failed to run and communicate with flasher stub", st);
+    mac_.clear();
+    util::Status st = flasher_client.connectResident();
+    if (st.ok()) {
+      emit statusMessage(tr("Connected to running flasher"), true);
+      // Device may have been swapped since the stub was loaded, so it is
+      // identified again. If that fails, write resume and the digest cache
+      // stay off.
+      auto mac = flasher_client.readMAC();
+      if (mac.ok()) {
+        mac_ = QString(mac.ValueOrDie().toHex());
+      } else {
+        qWarning() << "Error reading MAC address:" << mac.status();
+      }
+    } else {
+      st = connectFlasher(&rom, &flasher_client);
+      if (!st.ok()) return st;
     }
+    // Used both to tell flash chips apart in the digest cache and to detect
+    // flash size.
+    const util::StatusOr<quint32> chipID = flasher_client.getFlashChipID();
+    openDigestCache(chipID);
 
     if (override_flash_params_ >= 0) {
       // This really can't go wrong, we parsed the params.
       flashSize_ = flashSizeFromParams(override_flash_params_).ValueOrDie();
     } else if (flashSize_ == 0) {
       qInfo() << "Detecting flash size...";
-      auto flashChipIDRes = flasher_client.getFlashChipID();
-      if (flashChipIDRes.ok()) {
-        quint32 mfg = (flashChipIDRes.ValueOrDie() & 0xff000000) >> 24;
-        quint32 type = (flashChipIDRes.ValueOrDie() & 0x00ff0000) >> 16;
-        quint32 capacity = (flashChipIDRes.ValueOrDie() & 0x0000ff00) >> 8;
-        qInfo() << "Flash chip ID:" << hex << showbase << mfg << type
-                << capacity;
-        if (mfg != 0 && capacity >= 0x13 && capacity < 0x20) {
-          // Capacity is the power of two.
-          flashSize_ = 1 << capacity;
-        }
-      }
+      Phase detect(this, "detect");
+      auto flashSizeRes = chipID.ok()
+                              ? flashSizeFromChipID(chipID.ValueOrDie())
+                              : util::StatusOr<quint32>(chipID.status());
+      if (flashSizeRes.ok()) flashSize_ = flashSizeRes.ValueOrDie();
+      detect.end(flashSize_ != 0);
       if (flashSize_ == 0) {
         qWarning()
-            << "Failed to detect flash size:" << flashChipIDRes.status()
+            << "Failed to detect flash size:" << flashSizeRes.status()
             << ", defaulting 512K. You may want to specify size explicitly "
                "using --flash-size.";
         flashSize_ = 512 * 1024;  // A safe default.
@@ -379,8 +424,12 @@ class FlasherImpl : public Flasher {
             flashParamsFromString(
                 tr("dio,%1m,40m").arg(flashSize_ * 8 / 1048576)).ValueOrDie();
       }
-      images_[0].data[2] = (flashParams >> 8) & 0xff;
-      images_[0].data[3] = flashParams & 0xff;
+      const char fp2 = (flashParams >> 8) & 0xff, fp3 = flashParams & 0xff;
+      if (images_[0].data[2] != fp2 || images_[0].data[3] != fp3) {
+        images_[0].data[2] = fp2;
+        images_[0].data[3] = fp3;
+        images_[0].deflated.clear();
+      }
       emit statusMessage(
           tr("Setting flash params to 0x%1").arg(flashParams, 0, 16), true);
     }
@@ -390,10 +439,13 @@ class FlasherImpl : public Flasher {
                    .arg(spiffs_offset_, 0, 16)
                    .toUtf8();
     if (merge_flash_filesystem_ && images_.contains(spiffs_offset_)) {
+      Phase merge(this, "merge");
       auto res = mergeFlashLocked(&flasher_client);
+      merge.end(res.ok());
       if (res.ok()) {
         if (res.ValueOrDie().size() > 0) {
           images_[spiffs_offset_].data = res.ValueOrDie();
+          images_[spiffs_offset_].deflated.clear();
         } else {
           images_.remove(spiffs_offset_);
         }
@@ -410,46 +462,100 @@ class FlasherImpl : public Flasher {
     auto flashImages = images_;
     if (erase_chip_) {
       emit statusMessage(tr("Erasing chip..."), true);
+      Phase erase(this, "erase");
+      if (digestCache_ != nullptr) digestCache_->clear();
       st = flasher_client.eraseChip();
+      erase.end(st.ok());
       if (!st.ok()) return st;
     } else if (minimize_writes_) {
+      Phase dedup(this, "dedup");
       flashImages = dedupImages(&flasher_client);
+      dedup.end(true);
     }
 
     emit statusMessage(tr("Writing..."), true);
+    Phase write(this, "write");
+    // Whether some write started from the middle, trusting earlier flash
+    // contents.
+    bool resumed = false;
     for (ulong image_addr : flashImages.keys()) {
       const Image &image = flashImages[image_addr];
-      QByteArray data = image.data;
+      const QByteArray data = padToSector(image.data);
       emit progress(progress_);
-      int origLength = data.length();
+      int origLength = imageBytesIn(image_addr, image.data.length());
 
-      if (data.length() % flasher_client.kFlashSectorSize != 0) {
-        quint32 padLen = flasher_client.kFlashSectorSize -
-                         (data.length() % flasher_client.kFlashSectorSize);
-        data.reserve(data.length() + padLen);
-        while (padLen-- > 0) data.append('\x00');
+      quint32 offset = resumeOffset(&flasher_client, image_addr, data);
+      if (offset > 0) {
+        resumed = true;
+        emit statusMessage(tr("  %1 @ 0x%2, resuming @ 0x%3...")
+                               .arg(data.length())
+                               .arg(image_addr, 0, 16)
+                               .arg(image_addr + offset, 0, 16),
+                           true);
+      } else {
+        emit statusMessage(
+            tr("  %1 @ 0x%2...").arg(data.length()).arg(image_addr, 0, 16),
+            true);
+      }
+      // Bytes the stub has confirmed writing, counting from offset.
+      quint32 numAcked = 0;
+      connect(&flasher_client, &ESPFlasherClient::progress,
+              [this, origLength, &offset, &numAcked](int bytesWritten) {
+                numAcked = bytesWritten;
+                emit progress(this->progress_ +
+                              std::min(int(offset) + bytesWritten, origLength));
+              });
+      st = writeImageFrom(&flasher_client, image, data, offset);
+      // Stub can't be trusted after a failed write, start over one step
+      // down, from the last sector it has confirmed, until out of steps.
+      for (qint32 lowerBaudRate =
+               ESPFlasherClient::lowerBaudRate(rom.data_port()->baudRate());
+           !st.ok() && auto_baud_rate_ && lowerBaudRate > 0;
+           lowerBaudRate = ESPFlasherClient::lowerBaudRate(lowerBaudRate)) {
+        qWarning() << "Write failed:" << st << ", retrying @" << lowerBaudRate;
+        emit statusMessage(tr("  retrying @ %1...").arg(lowerBaudRate), true);
+        write.retry();
+        offset = sectorFloor(offset + numAcked);
+        numAcked = 0;
+        if (offset > 0) resumed = true;
+        flasher_client.disconnect();
+        st = rom.connect();
+        if (st.ok()) st = flasher_client.connect(lowerBaudRate);
+        if (st.ok()) st = writeImageFrom(&flasher_client, image, data, offset);
       }
-
-      emit statusMessage(
-          tr("  %1 @ 0x%2...").arg(data.length()).arg(image_addr, 0, 16), true);
-      connect(
-          &flasher_client, &ESPFlasherClient::progress,
-          [this, origLength](int bytesWritten) {
-            emit progress(this->progress_ + std::min(bytesWritten, origLength));
-          });
-      st = flasher_client.write(image_addr, data, true /* erase */);
       disconnect(&flasher_client, &ESPFlasherClient::progress, 0, 0);
       if (!st.ok()) {
+        saveWriteJournal(image_addr,
+                         image_addr + sectorFloor(offset + numAcked));
         return QS(util::error::UNAVAILABLE,
                   tr("failed to flash image at 0x%1: %2")
                       .arg(image_addr, 0, 16)
                       .arg(st.ToString().c_str()));
       }
       progress_ += origLength;
+      write.addBytes(data.length() - offset);
+    }
+    clearWriteJournal();
+    write.end(true);
+
+    // Stub that verifies writes has already read everything back, and the
+    // rest has been checked by dedupImages. Resumed writes only covered part
+    // of their images though, so then all of them are checked.
+    if (!flasher_client.verifiesWrites() || resumed) {
+      Phase verify(this, "verify");
+      st = verifyImages(&flasher_client);
+      verify.end(st.ok());
+      if (!st.ok()) return QSP("verification failed", st);
     }
+    updateDigestCache();
 
-    st = verifyImages(&flasher_client);
-    if (!st.ok()) return QSP("verification failed", st);
+    if (keep_stub_) {
+      st = flasher_client.leaveRunning();
+      if (!st.ok()) qWarning() << "Flasher can't be reused:" << st;
+      emit statusMessage(tr("Flashing successful, flasher left running"),
+                         true);
+      return util::Status::OK;
+    }
 
     emit statusMessage(tr("Flashing successful, booting firmare..."), true);
 
@@ -465,8 +571,10 @@ class FlasherImpl : public Flasher {
     // So, what we do is we do both: tell the flasher to boot firmware *and*
     // tickle RTS as well. Thus, setups that have control lines connected will
     // get a "proper" hardware reset, while setups that don't will still work.
+    Phase boot(this, "boot");
     st = flasher_client.bootFirmware();  // Jumps to flash loader routine.
     rom.rebootIntoFirmware();            // Uses RTS.
+    boot.end(st.ok());
     return st;
   }
 
@@ -597,83 +705,442 @@ class FlasherImpl : public Flasher {
     return merged;
   }
 
+  // data is image.data padded to sector size.
+  util::Status writeImage(ESPFlasherClient *fc, const Image &image,
+                          const QByteArray &data) {
+    const bool compress = compress_writes_ && fc->deflateSupported();
+    if (compress && !image.deflated.isEmpty()) {
+      // Compressed stream from the bundle, the stub pads it the same way.
+      return fc->writeDeflatedStream(
+          image.addr, data.length(), image.deflated,
+          QCryptographicHash::hash(data, QCryptographicHash::Md5),
+          true /* erase */, skip_blank_erase_);
+    } else if (compress) {
+      return fc->writeDeflated(image.addr, data, true /* erase */,
+                               skip_blank_erase_);
+    } else {
+      return fc->write(image.addr, data, true /* erase */, skip_blank_erase_);
+    }
+  }
+
+  // Writes data from offset on, e.g. to resume an interrupted write.
+  // Offset must be sector-aligned.
+  util::Status writeImageFrom(ESPFlasherClient *fc, const Image &image,
+                              const QByteArray &data, quint32 offset) {
+    if (offset == 0) return writeImage(fc, image, data);
+    Image tail(image);
+    tail.addr += offset;
+    tail.deflated.clear();  // Bundle's stream is for the whole image.
+    return writeImage(fc, tail, data.mid(offset));
+  }
+
+  static quint32 sectorFloor(quint32 offset) {
+    return offset - offset % ESPFlasherClient::kFlashSectorSize;
+  }
+
+  // Write journal records how far each of images_ got before a write
+  // failed, by device MAC, image address and digest of the image, so that
+  // the next attempt can pick up from there even if it splits images into
+  // writes differently.
+  QString writeJournalKey(ulong addr) const {
+    return QString("esp8266/writeJournal/%1/0x%2").arg(mac_).arg(addr, 0, 16);
+  }
+
+  static QByteArray journalDigest(const Image &image) {
+    return QCryptographicHash::hash(padToSector(image.data),
+                                    QCryptographicHash::Sha1);
+  }
+
+  // Records that a write that started at writeAddr got up to writtenEnd,
+  // for each image it covered. Sectors of those images before writeAddr
+  // were either written by earlier writes or found to be up to date.
+  void saveWriteJournal(ulong writeAddr, ulong writtenEnd) {
+    if (mac_.isEmpty()) return;
+    QSettings settings;
+    for (const Image &image : images_) {
+      const ulong imageEnd = image.addr + padToSector(image.data).length();
+      if (imageEnd <= writeAddr || image.addr >= writtenEnd) continue;
+      const quint32 numWritten = std::min(writtenEnd, imageEnd) - image.addr;
+      settings.setValue(writeJournalKey(image.addr) + "/digest",
+                        journalDigest(image).toHex());
+      settings.setValue(writeJournalKey(image.addr) + "/written", numWritten);
+      qInfo() << "Image @" << hex << showbase << image.addr << "written up to"
+              << numWritten;
+    }
+  }
+
+  void clearWriteJournal() {
+    if (mac_.isEmpty()) return;
+    QSettings().remove(QString("esp8266/writeJournal/%1").arg(mac_));
+  }
+
+  // Returns the offset to resume a write of data at addr from, 0 to write
+  // all of it. Sector just before the offset is checked to make sure the
+  // flash has not been changed since the journal was written.
+  quint32 resumeOffset(ESPFlasherClient *fc, ulong addr,
+                       const QByteArray &data) {
+    if (mac_.isEmpty() || erase_chip_) return 0;
+    // Image the write starts in.
+    auto it = images_.upperBound(addr);
+    if (it == images_.begin()) return 0;
+    const Image &image = *(--it);
+    QSettings settings;
+    const QString key = writeJournalKey(image.addr);
+    if (!settings.contains(key + "/digest") ||
+        settings.value(key + "/digest").toByteArray() !=
+            journalDigest(image).toHex()) {
+      return 0;
+    }
+    const ulong writtenEnd =
+        image.addr + sectorFloor(settings.value(key + "/written").toUInt());
+    if (writtenEnd <= addr || writtenEnd >= addr + data.length()) return 0;
+    const quint32 offset = writtenEnd - addr;
+    const quint32 sectorSize = ESPFlasherClient::kFlashSectorSize;
+    auto res = fc->digest(addr + offset - sectorSize, sectorSize, sectorSize);
+    const QByteArray expected = QCryptographicHash::hash(
+        data.mid(offset - sectorSize, sectorSize), QCryptographicHash::Md5);
+    if (!res.ok() || res.ValueOrDie().digest != expected) {
+      qInfo() << "Flash @" << hex << showbase << addr
+              << "does not match the journal, writing all of it";
+      return 0;
+    }
+    qInfo() << "Resuming write @" << hex << showbase << addr << "from"
+            << offset;
+    return offset;
+  }
+
+  // Connects to the ROM loader, prompting user to retry, and loads the stub.
+  util::Status connectFlasher(ESPROMClient *rom, ESPFlasherClient *fc) {
+    emit statusMessage("Connecting to ROM...", true);
+
+    Phase connectPhase(this, "connect");
+    util::Status st;
+    while (true) {
+      st = rom->connect();
+      if (st.ok()) break;
+      connectPhase.retry();
+      qCritical() << st;
+      QString msg = tr(FLASHING_MSG "\n\nError: %1")
+                        .arg(QString::fromUtf8(st.ToString().c_str()));
+      int answer = prompter_->Prompt(
+          msg, {{tr("Retry"), Prompter::ButtonRole::No},
+                {tr("Cancel"), Prompter::ButtonRole::Reject}});
+      if (answer == 1) {
+        return util::Status(util::error::UNAVAILABLE,
+                            "Failed to talk to bootloader.");
+      }
+    }
+    connectPhase.end(true);
+
+    auto mac = rom->readMAC();
+    if (mac.ok()) {
+      mac_ = QString(mac.ValueOrDie().toHex());
+    } else {
+      qWarning() << "Error reading MAC address:" << mac.status();
+    }
+
+    if (auto_baud_rate_) {
+      emit statusMessage(tr("Running flasher, picking baud rate..."), true);
+    } else {
+      emit statusMessage(tr("Running flasher @ %1...").arg(flashing_speed_),
+                         true);
+    }
+
+    Phase stubPhase(this, "stub");
+    st = fc->connect(flashing_speed_, auto_baud_rate_);
+    stubPhase.end(st.ok());
+    if (!st.ok()) {
+      return QSP("Failed to run and communicate with flasher stub", st);
+    }
+    return util::Status::OK;
+  }
+
+  static QByteArray padToSector(const QByteArray &data) {
+    const int sectorSize = ESPFlasherClient::kFlashSectorSize;
+    const int padLen = (sectorSize - data.length() % sectorSize) % sectorSize;
+    if (padLen == 0) return data;
+    QByteArray padded;
+    padded.reserve(data.length() + padLen);
+    padded.append(data);
+    padded.append(QByteArray(padLen, '\x00'));
+    return padded;
+  }
+
+  // Sets up the digest cache of the device, if it can be identified.
+  void openDigestCache(const util::StatusOr<quint32> &chipID) {
+    digestCache_.reset();
+    if (mac_.isEmpty() || !chipID.ok()) return;
+    const QString chip =
+        QString("%1").arg(chipID.ValueOrDie(), 8, 16, QChar('0'));
+    digestCache_.reset(new ESPDigestCache(mac_ + "-" + chip));
+    digestCache_->load();
+  }
+
+  // Flash now has all the images in it (padded, like they are written).
+  void updateDigestCache() {
+    if (digestCache_ == nullptr) return;
+    for (const Image &image : images_) {
+      digestCache_->update(image.addr, padToSector(image.data),
+                           ESPFlasherClient::kFlashSectorSize);
+    }
+    util::Status st = digestCache_->save();
+    if (!st.ok()) qWarning() << "Failed to save digest cache:" << st;
+  }
+
   QMap<ulong, Image> dedupImages(ESPFlasherClient *fc) {
-    QMap<ulong, Image> result;
     emit statusMessage("Deduping...", true);
-    for (auto im = images_.constBegin(); im != images_.constEnd(); im++) {
-      const ulong addr = im.key();
-      const Image &image = im.value();
+    // Per sector of all the images, in order.
+    QVector<bool> differs;
+    // Images that are in the digest cache are checked with a single digest
+    // each. If the flash still has what the cache says, sectors that differ
+    // are known without asking the device. The stub still reads and hashes
+    // all of the image, so this saves line time (a digest per sector going
+    // to the stub, or from it with stubs that only have digest), not flash
+    // reads.
+    // Expected digests of all the sectors of the rest are sent to the stub at
+    // once, it responds with a bitmap of the ones that differ.
+    QVector<ESPFlasherClient::SectorDigest> sectors;
+    QVector<int> sectorIndex;  // Of each of the sectors in differs.
+    for (const Image &image : images_) {
       const QByteArray &data = image.data;
-      qInfo() << tr("Checksumming %1 @ 0x%2...")
-                     .arg(data.length())
-                     .arg(addr, 0, 16);
-      ESPFlasherClient::DigestResult digests;
-      auto dr = fc->digest(addr, data.length(), fc->kFlashSectorSize);
-      if (!dr.ok()) {
-        qWarning() << "Error computing digest:" << dr.status();
-        return images_;
-      }
-      QMap<ulong, Image> newImages;
-      digests = dr.ValueOrDie();
-      int numBlocks =
-          (data.length() + fc->kFlashSectorSize - 1) / fc->kFlashSectorSize;
-      quint32 newAddr = addr, newLen = 0;
-      quint32 newImageSize = 0;
-      for (int i = 0; i < numBlocks; i++) {
-        int offset = i * fc->kFlashSectorSize;
-        int len = fc->kFlashSectorSize;
-        if (len > data.length() - offset) len = data.length() - offset;
-        const QByteArray &hash = QCryptographicHash::hash(
-            data.mid(offset, len), QCryptographicHash::Md5);
-        qDebug() << i << offset << len << hash.toHex()
-                 << digests.blockDigests[i].toHex();
-        if (hash == digests.blockDigests[i]) {
-          // This block is the same, skip it. Flush previous image, if any.
-          if (newLen > 0) {
-            Image newImage(image);
-            newImage.addr = newAddr;
-            newImage.data = data.mid(newAddr - addr, newLen);
-            newImages[newAddr] = newImage;
-            newLen = 0;
-            qDebug() << "New image:" << newImage.data.length() << "@" << hex
-                     << showbase << newAddr;
+      const QByteArray padded = padToSector(data);
+      ESPDigestCache::Region cached;
+      if (digestCache_ != nullptr &&
+          digestCache_->lookup(image.addr, padded.length(),
+                               fc->kFlashSectorSize, &cached)) {
+        auto dr = fc->digest(image.addr, padded.length(), 0);
+        if (dr.ok() && dr.ValueOrDie().digest == cached.digest) {
+          for (int i = 0; i < cached.sectorDigests.size(); i++) {
+            const QByteArray sector = QByteArray::fromRawData(
+                padded.constData() + i * fc->kFlashSectorSize,
+                fc->kFlashSectorSize);
+            differs.append(
+                QCryptographicHash::hash(sector, QCryptographicHash::Md5) !=
+                cached.sectorDigests[i]);
           }
-          progress_ += len;
-          emit progress(progress_);
-        } else {
-          // This block is different. Start new or extend existing image.
-          if (newLen == 0) {
-            newAddr = addr + i * fc->kFlashSectorSize;
-          }
-          newLen += len;
-          newImageSize += len;
+          qDebug() << "Image @" << hex << showbase << image.addr
+                   << "matches the digest cache";
+          continue;
         }
+        qInfo() << "Flash @" << hex << showbase << image.addr
+                << "does not match the digest cache";
       }
-      if (newLen > 0) {
-        Image newImage(image);
-        newImage.addr = newAddr;
-        newImage.data = data.mid(newAddr - addr, newLen);
-        newImages[newAddr] = newImage;
-        qDebug() << "New image:" << newImage.data.length() << "@" << hex
-                 << showbase << newAddr;
-      }
-      qInfo() << hex << showbase << addr << "was" << dec << data.length()
-              << "now" << newImageSize << "diff"
-              << (data.length() - newImageSize);
-      // There's a price for fragmenting a large image: erasing many individual
-      // sectors is slower than erasing a whole block. So unless the difference
-      // is substantial, don't bother.
-      if (data.length() - newImageSize >= ESPFlasherClient::kFlashBlockSize) {
-        result.unite(newImages);  // There are no dup keys, so unite is ok.
-        emit statusMessage(tr("  %1 @ 0x%2 reduced to %3")
-                               .arg(data.length())
-                               .arg(addr, 0, 16)
-                               .arg(newImageSize),
-                           true);
+      for (int offset = 0; offset < data.length();
+           offset += fc->kFlashSectorSize) {
+        ESPFlasherClient::SectorDigest sd;
+        sd.addr = image.addr + offset;
+        sd.len = std::min(int(fc->kFlashSectorSize), data.length() - offset);
+        sd.digest = QCryptographicHash::hash(data.mid(offset, sd.len),
+                                             QCryptographicHash::Md5);
+        sectors.append(sd);
+        sectorIndex.append(differs.size());
+        differs.append(true);
+      }
+    }
+    if (!sectors.isEmpty()) {
+      qInfo() << tr("Checking %1 sectors...").arg(sectors.size());
+      auto dr = fc->sectorDiff(sectors);
+      if (dr.status().error_code() == util::error::UNIMPLEMENTED) {
+        dr = digestDiff(fc, sectors);
+      }
+      if (dr.ok()) {
+        for (int i = 0; i < sectors.size(); i++) {
+          differs[sectorIndex[i]] = dr.ValueOrDie()[i];
+        }
       } else {
-        result[addr] = image;
+        // Sectors that are still unknown are rewritten.
+        qWarning() << "Error computing digest:" << dr.status();
+      }
+    }
+    return planWrites(differs, fc->baudRate(),
+                      compress_writes_ && fc->deflateSupported());
+  }
+
+  // Same as ESPFlasherClient::sectorDiff, for stubs that do not have it:
+  // block digests of each run of contiguous sectors are requested and
+  // compared here.
+  util::StatusOr<QVector<bool>> digestDiff(
+      ESPFlasherClient *fc,
+      const QVector<ESPFlasherClient::SectorDigest> &sectors) {
+    QVector<bool> result;
+    result.reserve(sectors.size());
+    for (int start = 0, end = 0; start < sectors.size(); start = end) {
+      quint32 len = sectors[start].len;
+      for (end = start + 1; end < sectors.size() &&
+                            sectors[end - 1].len == fc->kFlashSectorSize &&
+                            sectors[end].addr == sectors[start].addr + len;
+           end++) {
+        len += sectors[end].len;
+      }
+      auto dr = fc->digest(sectors[start].addr, len, fc->kFlashSectorSize);
+      if (!dr.ok()) return dr.status();
+      const QVector<QByteArray> &digests = dr.ValueOrDie().blockDigests;
+      if (digests.size() != end - start) {
+        return QS(util::error::INTERNAL,
+                  tr("expected %1 digests, got %2")
+                      .arg(end - start)
+                      .arg(digests.size()));
+      }
+      for (int i = start; i < end; i++) {
+        result.append(digests[i - start] != sectors[i].digest);
+      }
+    }
+    return result;
+  }
+
+  // A contiguous span of flash covered by one or more images.
+  struct Region {
+    ulong addr;
+    QByteArray data;
+    QVector<bool> dirty;  // Per sector.
+  };
+
+  // Estimated time it takes to write numSectors starting at firstSector with
+  // a single write command, in milliseconds. numBytes are sent over the
+  // line. Erases are planned by the stub: sectors up to the first block
+  // boundary, then blocks, then sectors again.
+  static double writeCost(quint32 firstSector, quint32 numSectors,
+                          double numBytes, qint32 baudRate) {
+    const quint32 sectorsPerBlock =
+        ESPFlasherClient::kFlashBlockSize / ESPFlasherClient::kFlashSectorSize;
+    const quint32 end = firstSector + numSectors;
+    const quint32 firstBlock =
+        (firstSector + sectorsPerBlock - 1) / sectorsPerBlock * sectorsPerBlock;
+    const quint32 head = std::min(end, firstBlock) - firstSector;
+    const quint32 rest = numSectors - head;
+    const quint32 numBlocks = rest / sectorsPerBlock;
+    const quint32 numSectorErases = head + rest % sectorsPerBlock;
+    const double bytesMs = 1000.0 * numBytes * 10 / baudRate;
+    return kWriteCmdCostMs + bytesMs + numBlocks * kBlockEraseCostMs +
+           numSectorErases * kSectorEraseCostMs;
+  }
+
+  // Size of a sector after compression, as sent by writeDeflated. Sectors
+  // are compressed separately, so this overestimates a bit. The compressor
+  // is big (hundreds of KB), so callers allocate it once and pass it in.
+  static int deflatedSize(tdefl_compressor *d, const char *sector) {
+    const int sectorSize = ESPFlasherClient::kFlashSectorSize;
+    QByteArray out(sectorSize, 0);
+    size_t inLen = sectorSize, outLen = out.size();
+    if (tdefl_init(d, nullptr, nullptr, TDEFL_DEFAULT_MAX_PROBES) !=
+            TDEFL_STATUS_OKAY ||
+        tdefl_compress(d, sector, &inLen, out.data(), &outLen, TDEFL_FINISH) !=
+            TDEFL_STATUS_DONE) {
+      // Did not fit, i.e. did not compress.
+      return sectorSize;
+    }
+    return int(outLen);
+  }
+
+  // Number of bytes of images_ in the given range of flash, not counting
+  // padding. This is what progress is measured in.
+  int imageBytesIn(ulong addr, int len) const {
+    int r = 0;
+    for (const Image &image : images_) {
+      const ulong start = std::max(addr, image.addr);
+      const ulong end =
+          std::min(addr + len, image.addr + image.data.length());
+      if (start < end) r += end - start;
+    }
+    return r;
+  }
+
+  // Turns per-sector dirty map of images_ (in the same order as the images
+  // and their sectors) into the cheapest set of writes that covers all the
+  // dirty sectors. Adjacent images are merged, so a write can span several.
+  // Transfer time is estimated for baudRate, with compression if compressed
+  // is set. Assumes the stub erases every sector it writes, so a clean
+  // sector included in a write costs an erase as well as the transfer.
+  QMap<ulong, Image> planWrites(const QVector<bool> &differs, qint32 baudRate,
+                                bool compressed) {
+    const int sectorSize = ESPFlasherClient::kFlashSectorSize;
+    std::unique_ptr<tdefl_compressor> compressor(
+        compressed ? new tdefl_compressor : nullptr);
+    QList<Region> regions;
+    int sectorIndex = 0;
+    for (const Image &image : images_) {
+      const int numSectors =
+          (image.data.length() + sectorSize - 1) / sectorSize;
+      if (regions.isEmpty() ||
+          regions.last().addr + regions.last().data.length() != image.addr) {
+        regions.append(Region{image.addr, QByteArray(), QVector<bool>()});
       }
+      Region &r = regions.last();
+      r.data.append(image.data);
+      // Last sector is padded when writing, do the same here.
+      r.data.append(QByteArray(numSectors * sectorSize - image.data.length(),
+                               '\x00'));
+      r.dirty += differs.mid(sectorIndex, numSectors);
+      sectorIndex += numSectors;
     }
+
+    QMap<ulong, Image> result;
+    int totalLen = 0, newLen = 0;
+    for (const Image &image : images_) totalLen += image.data.length();
+    for (const Region &r : regions) {
+      const int n = r.dirty.size();
+      const quint32 firstSector = r.addr / sectorSize;
+      // sent[j] is the number of bytes sent for the first j sectors.
+      QVector<double> sent(n + 1, 0);
+      for (int j = 0; j < n; j++) {
+        sent[j + 1] =
+            sent[j] + (compressed
+                           ? deflatedSize(compressor.get(),
+                                          r.data.constData() + j * sectorSize)
+                           : sectorSize);
+      }
+      // best[j] is the cost of writing all the dirty sectors among the first
+      // j, from[j] is the start of the last write or -1 if sector j - 1 is
+      // not written.
+      QVector<double> best(n + 1, 0);
+      QVector<int> from(n + 1, -1);
+      for (int j = 1; j <= n; j++) {
+        best[j] = r.dirty[j - 1] ? std::numeric_limits<double>::max()
+                                 : best[j - 1];
+        for (int i = 0; i < j; i++) {
+          const double c = best[i] + writeCost(firstSector + i, j - i,
+                                               sent[j] - sent[i], baudRate);
+          if (c < best[j]) {
+            best[j] = c;
+            from[j] = i;
+          }
+        }
+      }
+      for (int j = n; j > 0;) {
+        if (from[j] < 0) {
+          j--;
+          continue;
+        }
+        const int i = from[j];
+        const ulong addr = r.addr + i * sectorSize;
+        const int len = (j - i) * sectorSize;
+        if (images_.contains(addr) &&
+            (images_[addr].data.length() + sectorSize - 1) / sectorSize ==
+                j - i) {
+          // Entire image, keep it as is.
+          result[addr] = images_[addr];
+        } else {
+          // Attributes of the image it starts in.
+          Image image = *(--images_.upperBound(addr));
+          image.addr = addr;
+          image.data = r.data.mid(i * sectorSize, len);
+          image.deflated.clear();
+          result[addr] = image;
+        }
+        newLen += imageBytesIn(addr, result[addr].data.length());
+        qDebug() << "Write:" << dec << result[addr].data.length() << "@" << hex
+                 << showbase << addr;
+        j = i;
+      }
+    }
+    qInfo() << "Total" << totalLen << "to write" << newLen;
+    if (newLen < totalLen) {
+      emit statusMessage(
+          tr("  %1 reduced to %2").arg(totalLen).arg(newLen), true);
+    }
+    // Writes report their own progress, count the rest as done.
+    progress_ += totalLen - newLen;
+    emit progress(progress_);
     qDebug() << "After deduping:" << result.size() << "images";
     return result;
   }
@@ -706,7 +1173,7 @@ class FlasherImpl : public Flasher {
     return util::Status::OK;
   }
 
-  QSerialPort *port_;
+  Transport *port_;
   Prompter *prompter_;
 
   mutable QMutex lock_;
@@ -714,6 +1181,10 @@ class FlasherImpl : public Flasher {
   QMap<ulong, Image> images_;
   std::unique_ptr<ESPROMClient> rom_;
   int progress_ = 0;
+  // Of the device being flashed, if read from it in this session. Write
+  // journal and digest cache are keyed by it and not used without it.
+  QString mac_;
+  std::unique_ptr<ESPDigestCache> digestCache_;
   quint32 flashSize_ = 0;
   bool erase_chip_ = false;
   qint32 override_flash_params_ = -1;
@@ -721,6 +1192,10 @@ class FlasherImpl : public Flasher {
   QString flashing_port_name_;
   int flashing_speed_ = kDefaultFlashBaudRate;
   bool minimize_writes_ = true;
+  bool compress_writes_ = true;
+  bool skip_blank_erase_ = true;
+  bool keep_stub_ = false;
+  bool auto_baud_rate_ = false;
   ulong spiffs_size_ = 0;
   ulong spiffs_offset_ = 0;
   QString fs_dump_filename_;
@@ -728,12 +1203,20 @@ class FlasherImpl : public Flasher {
 
 class ESP8266HAL : public HAL {
  public:
-  ESP8266HAL(QSerialPort *port) : port_(port) {
+  ESP8266HAL(Transport *port) : port_(port) {
   }
 
   util::Status probe() const override {
     ESPROMClient rom(port_, port_);
 
+    {
+      ESPFlasherClient fc(&rom);
+      if (fc.connectResident().ok()) {
+        qInfo() << "Flasher stub is running";
+        return util::Status::OK;
+      }
+    }
+
     if (!rom.connect().ok()) {
       return QS(util::error::UNAVAILABLE, FLASHING_MSG);
     }
@@ -781,13 +1264,70 @@ class ESP8266HAL : public HAL {
     return rom.rebootIntoFirmware();
   }
 
+  util::Status dumpFlash(const Config &config,
+                         const QString &fileName) const override {
+    QFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly)) {
+      return QS(util::error::UNAVAILABLE,
+                QObject::tr("failed to open %1: %2")
+                    .arg(fileName)
+                    .arg(f.errorString()));
+    }
+
+    int baudRate = config.value(Flasher::kFlashBaudRateOption).toInt();
+    if (baudRate <= 0) baudRate = kDefaultFlashBaudRate;
+    ESPROMClient rom(port_, port_);
+    ESPFlasherClient fc(&rom);
+    // Reuses the stub if it's still running, connects to ROM otherwise.
+    util::Status st =
+        fc.connect(baudRate, config.boolValue(kAutoBaudRateOption));
+    if (!st.ok()) {
+      return QSP(FLASHING_MSG "\nFailed to run flasher stub", st);
+    }
+
+    quint32 flashSize = 0;
+    if (config.isSet(kFlashSizeOption)) {
+      auto res = parseSize(config.value(kFlashSizeOption));
+      if (!res.ok()) return QSP(kFlashSizeOption, res.status());
+      flashSize = res.ValueOrDie();
+    } else {
+      auto res = detectFlashSize(&fc);
+      if (!res.ok()) {
+        return QSP("failed to detect flash size, use --esp8266-flash-size",
+                   res.status());
+      }
+      flashSize = res.ValueOrDie();
+    }
+
+    qInfo() << "Reading" << flashSize << "bytes of flash...";
+    auto data = fc.read(0, flashSize);
+    if (!data.ok()) return QSP("failed to read flash", data.status());
+    if (f.write(data.ValueOrDie()) != data.ValueOrDie().length()) {
+      return QS(util::error::UNAVAILABLE,
+                QObject::tr("failed to write %1: %2")
+                    .arg(fileName)
+                    .arg(f.errorString()));
+    }
+
+    if (config.boolValue(kKeepStubOption)) {
+      st = fc.leaveRunning();
+      if (!st.ok()) qWarning() << "Flasher can't be reused:" << st;
+      return util::Status::OK;
+    }
+
+    // Same as after flashing, see the comment in FlasherImpl::runLocked.
+    st = fc.bootFirmware();
+    rom.rebootIntoFirmware();
+    return st;
+  }
+
  private:
-  QSerialPort *port_;
+  Transport *port_;
 };
 
 }  // namespace
 
-std::unique_ptr<::HAL> HAL(QSerialPort *port) {
+std::unique_ptr<::HAL> HAL(Transport *port) {
   return std::move(std::unique_ptr<::HAL>(new ESP8266HAL(port)));
 }
 
@@ -904,6 +1444,25 @@ void addOptions(Config *config) {
       kNoMinimizeWritesOption,
       "If set, no attempt will be made to minimize the number of blocks to "
       "write by comparing current contents with the images being written."));
+  opts.append(QCommandLineOption(
+      kNoCompressWritesOption,
+      "If set, images are sent to the device as is. By default they are "
+      "compressed on the host and decompressed by the flasher stub."));
+  opts.append(QCommandLineOption(
+      kNoBlankCheckOption,
+      "If set, flash is always erased before writing. By default the flasher "
+      "stub skips erasing regions that are already blank."));
+  opts.append(QCommandLineOption(
+      kKeepStubOption,
+      "If set, flasher stub is left running after flashing or dumping flash "
+      "instead of booting the firmware, so that the next operation on the "
+      "same port can skip loading it. Device must be reset to boot."));
+  opts.append(QCommandLineOption(
+      kAutoBaudRateOption,
+      "If set, the fastest baud rate that works reliably is picked "
+      "automatically. Flasher stubs that can't change the rate run at "
+      "--flash-baud-rate instead. If a write fails, it is retried at lower "
+      "rates."));
   opts.append(QCommandLineOption(kFlashEraseChipOption,
                                  "If set, erase entire chip before flashing.",
                                  "<true|false>", "false"));
@@ -8,13 +8,13 @@
 
 #include <memory>
 
-#include <QSerialPort>
 #include <QString>
 
 #include <common/util/status.h>
 #include <common/util/statusor.h>
 
 #include "hal.h"
+#include "transport.h"
 
 class Config;
 
@@ -27,7 +27,7 @@ void addOptions(Config *config);
 
 QByteArray makeIDBlock(const QString &domain);
 
-std::unique_ptr<HAL> HAL(QSerialPort *port);
+std::unique_ptr<HAL> HAL(Transport *port);
 
 }  // namespace ESP8266
 
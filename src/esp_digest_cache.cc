@@ -0,0 +1,122 @@
+#include "esp_digest_cache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QObject>
+#include <QRegExp>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtDebug>
+
+#include <common/util/error_codes.h>
+
+#include "status_qt.h"
+
+namespace {
+
+const quint32 kMagic = 0x45444331;  // "EDC1"
+
+QString cacheFileName(const QString &deviceId) {
+  QString name(deviceId);
+  name.replace(QRegExp("[^0-9A-Za-z_-]"), "_");
+  return QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation))
+      .filePath(QString("esp8266-digests/%1").arg(name));
+}
+
+}  // namespace
+
+ESPDigestCache::ESPDigestCache(const QString &deviceId)
+    : fileName_(cacheFileName(deviceId)) {
+}
+
+bool ESPDigestCache::load() {
+  regions_.clear();
+  QFile f(fileName_);
+  if (!f.open(QIODevice::ReadOnly)) return false;
+  QDataStream s(&f);
+  quint32 magic = 0, numRegions = 0;
+  s >> magic >> numRegions;
+  if (magic != kMagic) {
+    qWarning() << fileName_ << "is not a digest cache";
+    return false;
+  }
+  for (quint32 i = 0; i < numRegions && s.status() == QDataStream::Ok; i++) {
+    Region r;
+    s >> r.addr >> r.len >> r.digest >> r.sectorDigests;
+    regions_[r.addr] = r;
+  }
+  if (s.status() != QDataStream::Ok) {
+    qWarning() << "Failed to read" << fileName_;
+    regions_.clear();
+    return false;
+  }
+  qDebug() << "Loaded" << regions_.size() << "regions from" << fileName_;
+  return true;
+}
+
+util::Status ESPDigestCache::save() const {
+  QDir().mkpath(QFileInfo(fileName_).path());
+  // Written in full or not at all, a truncated cache would be useless.
+  QSaveFile f(fileName_);
+  if (!f.open(QIODevice::WriteOnly)) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("failed to open %1: %2")
+                  .arg(fileName_)
+                  .arg(f.errorString()));
+  }
+  QDataStream s(&f);
+  s << kMagic << quint32(regions_.size());
+  for (const Region &r : regions_) {
+    s << r.addr << r.len << r.digest << r.sectorDigests;
+  }
+  if (!f.commit()) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("failed to write %1: %2")
+                  .arg(fileName_)
+                  .arg(f.errorString()));
+  }
+  return util::Status::OK;
+}
+
+bool ESPDigestCache::lookup(quint32 addr, quint32 len, quint32 sectorSize,
+                            Region *region) const {
+  auto it = regions_.find(addr);
+  if (it == regions_.end() || it->len != len) return false;
+  // Cache file may be stale or damaged.
+  if (len % sectorSize != 0 ||
+      quint32(it->sectorDigests.size()) != len / sectorSize) {
+    qWarning() << "Digest cache entry @" << addr << "is inconsistent";
+    return false;
+  }
+  *region = *it;
+  return true;
+}
+
+void ESPDigestCache::update(quint32 addr, const QByteArray &data,
+                            quint32 sectorSize) {
+  // Regions overlapping the new one are no longer valid.
+  for (auto it = regions_.begin(); it != regions_.end();) {
+    if (it->addr < addr + data.length() && addr < it->addr + it->len) {
+      it = regions_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  Region r;
+  r.addr = addr;
+  r.len = data.length();
+  r.digest = QCryptographicHash::hash(data, QCryptographicHash::Md5);
+  for (int offset = 0; offset < data.length(); offset += sectorSize) {
+    r.sectorDigests.append(QCryptographicHash::hash(
+        QByteArray::fromRawData(data.constData() + offset, sectorSize),
+        QCryptographicHash::Md5));
+  }
+  regions_[addr] = r;
+}
+
+void ESPDigestCache::clear() {
+  regions_.clear();
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_ESP_DIGEST_CACHE_H_
+#define CS_MFT_SRC_ESP_DIGEST_CACHE_H_
+
+#include <QByteArray>
+#include <QMap>
+#include <QString>
+#include <QVector>
+
+#include <common/util/status.h>
+
+// Digests of what was last written to the flash of a device, kept on disk
+// between runs. If a single digest of a region computed by the device matches
+// the cached one, per-sector digests of the region can be taken from the
+// cache instead of being computed by the device.
+class ESPDigestCache {
+ public:
+  struct Region {
+    quint32 addr = 0;
+    quint32 len = 0;
+    QByteArray digest;  // MD5 of the whole region.
+    QVector<QByteArray> sectorDigests;
+  };
+
+  // deviceId must identify the device and its flash chip, e.g. MAC and
+  // flash chip ID. Cache is empty until load() is called.
+  explicit ESPDigestCache(const QString &deviceId);
+
+  // Returns false if the cache file is missing or can't be read, in which
+  // case the cache stays empty.
+  bool load();
+  util::Status save() const;
+
+  // Returns true and fills in *region if the region of len bytes at addr
+  // is in the cache with a digest for each sector of sectorSize bytes.
+  bool lookup(quint32 addr, quint32 len, quint32 sectorSize,
+              Region *region) const;
+  // Records data as the contents of flash at addr. Length must be a multiple
+  // of sectorSize.
+  void update(quint32 addr, const QByteArray &data, quint32 sectorSize);
+  // Forgets everything, e.g. after the chip has been erased.
+  void clear();
+
+ private:
+  const QString fileName_;
+  QMap<quint32, Region> regions_;
+};
+
+#endif /* CS_MFT_SRC_ESP_DIGEST_CACHE_H_ */
@@ -1,14 +1,21 @@
 #include "esp_flasher_client.h"
 
+#include <algorithm>
+
 #include <QCryptographicHash>
 #include <QDataStream>
-#include <QFile>
+#include <QElapsedTimer>
+#include <QResource>
 #include <QObject>
+#include <QSettings>
+#include <QThread>
 
-#include "serial.h"
 #include "slip.h"
 #include "status_qt.h"
 
+#define MINIZ_HEADER_FILE_ONLY
+#include "common/miniz.c"
+
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
 #define qInfo qWarning
 #endif
@@ -22,7 +29,28 @@ const quint32 flashBlockEraseTimeMs = 900;
 const quint32 flashEraseMinTimeoutMs = 5000;
 const quint32 flashChipEraseTimeMs = 20000;
 
-const quint32 flashReadBlockSize = 1024;
+// Max number of regions in one CMD_FLASH_SECTOR_DIFF request and the time
+// it takes stub to check one.
+const int maxDiffSectors = 1024;
+const quint32 sectorDiffTimeMs = 10;
+
+// Number of read blocks the stub may send ahead of our acks.
+const quint32 flashReadBlocksInFlight = 4;
+
+// Stub answers pings right away, this is mostly the serial round trip.
+const int residentStubPingTimeoutMs = 200;
+
+// Rates tried by negotiateBaudRate, in order. ESP8266 UART can go higher,
+// but few USB-serial adapters can.
+const QList<qint32> baudRateLadder({230400, 460800, 921600, 1500000, 2000000});
+// Size of the test burst sent at each rate. Stub echoes it back.
+const int baudRateCheckBurstSize = 4096;
+// Stub goes back to the old rate if it doesn't hear from us in this time.
+const int stubBaudRateCheckTimeoutMs = 500;
+
+// Used with stubs that do not report buffer sizes in the greeting.
+const quint32 legacyStubBufferSize = 6144;
+const quint32 legacyStubWriteSize = 1024;
 
 QByteArray cmdByte(enum stub_cmd cmd) {
   QByteArray result;
@@ -30,6 +58,17 @@ QByteArray cmdByte(enum stub_cmd cmd) {
   return result;
 }
 
+// Settings key under which the baud rate of a stub left running on a port
+// is stored.
+QString residentStubKey(const Transport *port) {
+  return QString("esp8266/residentStubBaudRate/%1").arg(port->portName());
+}
+
+quint32 eraseArg(bool erase, bool skipBlank) {
+  if (!erase) return 0;
+  return ERASE_FLAG_ERASE | (skipBlank ? ERASE_FLAG_SKIP_BLANK : 0);
+}
+
 }  // namespace
 
 ESPFlasherClient::ESPFlasherClient(ESPROMClient *rom) : rom_(rom) {
@@ -42,53 +81,282 @@ ESPFlasherClient::~ESPFlasherClient() {
 const quint32 ESPFlasherClient::kFlashSectorSize = 4096;
 const quint32 ESPFlasherClient::kFlashBlockSize = 65536;
 
-util::Status ESPFlasherClient::connect(qint32 baudRate) {
-  const QString prefix = tr("ESPFlasherClient::connect(%1): ").arg(baudRate);
+util::Status ESPFlasherClient::connect(qint32 baudRate, bool autoBaudRate) {
+  const QString prefix = tr("ESPFlasherClient::connect(%1%2): ")
+                             .arg(baudRate)
+                             .arg(autoBaudRate ? ", auto" : "");
   qDebug() << prefix;
   if (!rom_->connected()) {
-    return util::Status(util::error::FAILED_PRECONDITION,
-                        "ESPROMClient not connected");
+    // Fast path: stub may have been left running by a previous session.
+    if (connectResident().ok()) return util::Status::OK;
+    util::Status st = rom_->connect();
+    if (!st.ok()) return QSP(prefix + "failed to connect to ROM", st);
+  }
+
+  // Start at the ROM rate and go from there, if the stub can.
+  util::Status st = startStub(autoBaudRate ? 0 : baudRate);
+  if (!st.ok()) return QSP(prefix, st);
+
+  if (autoBaudRate && !extendedStub_ &&
+      baudRate != rom_->data_port()->baudRate()) {
+    // It can't, so it has to be started over at the given rate.
+    qWarning() << "Flasher stub can't change baud rate, restarting it @"
+               << baudRate;
+    st = rom_->connect();
+    if (!st.ok()) return QSP(prefix + "failed to connect to ROM", st);
+    st = startStub(baudRate);
+    if (!st.ok()) return QSP(prefix, st);
+  }
+
+  if (autoBaudRate && extendedStub_) {
+    auto res = negotiateBaudRate();
+    if (!res.ok()) {
+      return QSP(prefix + "failed to negotiate baud rate", res.status());
+    }
+    qInfo() << "Using baud rate" << res.ValueOrDie();
   }
 
+  return util::Status::OK;
+}
+
+util::Status ESPFlasherClient::startStub(qint32 baudRate) {
   if (baudRate == rom_->data_port()->baudRate()) baudRate = 0;  // Don't change
 
-  QFile f(":/esp8266/stub_flasher.json");
-  if (!f.open(QIODevice::ReadOnly)) {
+  QResource stubRes(":/esp8266/stub_flasher.bin");
+  if (!stubRes.isValid()) {
     return util::Status(util::error::UNAVAILABLE, "Failed to open stub");
   }
-  util::Status st = rom_->runStub(f.readAll(), {quint32(baudRate)});
-  if (!st.ok()) return QSP(prefix + "runStub failed", st);
+  // Stub is stored uncompressed, so it is used in place.
+  const QByteArray stub =
+      stubRes.isCompressed()
+          ? qUncompress(stubRes.data(), stubRes.size())
+          : QByteArray::fromRawData((const char *) stubRes.data(),
+                                    stubRes.size());
+  util::Status st = rom_->runStub(stub, {quint32(baudRate)});
+  if (!st.ok()) return QSP("runStub failed", st);
 
   if (baudRate > 0) {
     oldBaudRate_ = rom_->data_port()->baudRate();
-    st = setSpeed(rom_->data_port(), baudRate);
-    if (!st.ok()) return QSP(prefix + "failed to set baud rate", st);
+    st = rom_->data_port()->setBaudRate(baudRate);
+    if (!st.ok()) return QSP("failed to set baud rate", st);
   }
 
-  auto res = SLIP::recv(rom_->data_port());
-  if (!res.ok()) return QSP(prefix + "failed to read hello", res.status());
+  auto res = rom_->data_decoder()->recv();
+  if (!res.ok()) return QSP("failed to read hello", res.status());
 
-  const QString greeting = QString::fromLatin1(res.ValueOrDie());
+  st = parseGreeting(res.ValueOrDie());
+  if (!st.ok()) return QSP("bad greeting", st);
 
-  if (greeting != "OHAI") {
+  // Not reusable until leaveRunning says so.
+  QSettings().remove(residentStubKey(rom_->data_port()));
+
+  return util::Status::OK;
+}
+
+util::Status ESPFlasherClient::setBaudRate(qint32 baudRate) {
+  const QString prefix =
+      tr("ESPFlasherClient::setBaudRate(%1): ").arg(baudRate);
+  qDebug() << prefix;
+  if (!extendedStub_) {
+    return QS(util::error::FAILED_PRECONDITION,
+              prefix + "not supported by the stub");
+  }
+  Transport *port = rom_->data_port();
+  const qint32 curBaudRate = port->baudRate();
+  util::Status st = SLIP::send(port, cmdByte(CMD_SET_BAUD_RATE));
+  if (!st.ok()) return QSP(prefix + "command write failed", st);
+  QByteArray args;
+  QDataStream s(&args, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s << quint32(baudRate);
+  st = SLIP::send(port, args);
+  if (!st.ok()) return QSP(prefix + "arg write failed", st);
+  auto ares = rom_->data_decoder()->recv();
+  if (!ares.ok()) return QSP(prefix + "failed to read ack", ares.status());
+  const QByteArray &ack = ares.ValueOrDie();
+  if (ack != args) {
     return QS(util::error::INTERNAL,
-              prefix + tr("unexpected greeting: %1").arg(greeting));
+              prefix + tr("unexpected ack: %1")
+                           .arg(QString::fromLatin1(ack.toHex())));
   }
+  st = port->setBaudRate(baudRate);
+  if (!st.ok()) return QSP(prefix + "failed to set baud rate", st);
+  // Give stub time to switch too.
+  QThread::msleep(10);
+  rom_->data_decoder()->flush();
 
-  qInfo() << "Connected to flasher";
+  // Pseudo-random burst, includes bytes that need to be escaped.
+  QByteArray burst(baudRateCheckBurstSize, 0);
+  quint32 x = baudRate;
+  for (int i = 0; i < burst.length(); i++) {
+    x = x * 1103515245 + 12345;
+    burst[i] = char(x >> 16);
+  }
+  st = SLIP::send(port, burst);
+  bool good = false;
+  if (st.ok()) {
+    auto eres = rom_->data_decoder()->recv(stubBaudRateCheckTimeoutMs);
+    good = (eres.ok() && eres.ValueOrDie() == burst);
+  }
+  if (good) {
+    st = SLIP::send(port, args);  // Confirm.
+    auto sres = rom_->data_decoder()->recv(stubBaudRateCheckTimeoutMs);
+    good = (st.ok() && sres.ok() && sres.ValueOrDie() == QByteArray(1, 0));
+  }
+  if (!good) {
+    // Stub will go back to the current rate once it times out and report an
+    // error, wait for it.
+    port->setBaudRate(curBaudRate);
+    QElapsedTimer timer;
+    timer.start();
+    while (true) {
+      const int remainingMs = 3 * stubBaudRateCheckTimeoutMs - timer.elapsed();
+      if (remainingMs <= 0) break;
+      auto res = rom_->data_decoder()->recv(remainingMs);
+      if (!res.ok() || res.ValueOrDie().length() == 1) break;
+    }
+    st = ping(residentStubPingTimeoutMs);
+    if (!st.ok()) return QSP(prefix + "lost contact with the stub", st);
+    return QS(util::error::UNAVAILABLE, prefix + "data corrupted at this rate");
+  }
+  if (oldBaudRate_ == 0) oldBaudRate_ = curBaudRate;
+  // Rate is no longer the one recorded, if any.
+  QSettings().remove(residentStubKey(port));
+  return util::Status::OK;
+}
+
+util::StatusOr<qint32> ESPFlasherClient::negotiateBaudRate() {
+  Transport *port = rom_->data_port();
+  for (const qint32 baudRate : baudRateLadder) {
+    if (baudRate <= port->baudRate()) continue;
+    util::Status st = setBaudRate(baudRate);
+    if (st.error_code() == util::error::UNAVAILABLE) {
+      qInfo() << "Baud rate" << baudRate << "does not work:" << st;
+      break;
+    }
+    if (!st.ok()) return st;
+  }
+  return port->baudRate();
+}
+
+// static
+qint32 ESPFlasherClient::lowerBaudRate(qint32 baudRate) {
+  qint32 result = 0;
+  for (const qint32 r : baudRateLadder) {
+    if (r < baudRate) result = r;
+  }
+  return result;
+}
+
+util::Status ESPFlasherClient::connectResident() {
+  const QString prefix = tr("ESPFlasherClient::connectResident(): ");
+  Transport *port = rom_->data_port();
+  QSettings settings;
+  const QString key = residentStubKey(port);
+  const qint32 stubBaudRate = settings.value(key, 0).toInt();
+  if (stubBaudRate <= 0) {
+    return QS(util::error::NOT_FOUND, prefix + "no stub left running");
+  }
+  qDebug() << prefix << stubBaudRate;
+  const qint32 portBaudRate = port->baudRate();
+  util::Status st;
+  if (stubBaudRate != portBaudRate) {
+    st = port->setBaudRate(stubBaudRate);
+    if (!st.ok()) return QSP(prefix + "failed to set baud rate", st);
+  }
+  st = ping(residentStubPingTimeoutMs);
+  if (!st.ok()) {
+    // Device must have been reset since.
+    settings.remove(key);
+    if (stubBaudRate != portBaudRate) port->setBaudRate(portBaudRate);
+    return QSP(prefix + "no response", st);
+  }
+  if (stubBaudRate != portBaudRate) oldBaudRate_ = portBaudRate;
+  qInfo() << "Reusing running flasher @" << stubBaudRate;
+  return util::Status::OK;
+}
+
+util::Status ESPFlasherClient::ping(int timeoutMs) {
+  Transport *port = rom_->data_port();
+  rom_->data_decoder()->flush();
+  util::Status st = SLIP::send(port, cmdByte(CMD_PING));
+  if (!st.ok()) return st;
+  // Skip anything left over from before, e.g. garbage from a baud rate change.
+  QElapsedTimer timer;
+  timer.start();
+  while (true) {
+    const int remainingMs = timeoutMs - timer.elapsed();
+    if (remainingMs <= 0) {
+      return QS(util::error::DEADLINE_EXCEEDED, tr("no response to ping"));
+    }
+    auto res = rom_->data_decoder()->recv(remainingMs);
+    if (!res.ok()) return res.status();
+    if (res.ValueOrDie().startsWith("OHAI")) {
+      st = parseGreeting(res.ValueOrDie());
+      break;
+    }
+  }
+  if (!st.ok()) return st;
+  auto sres = rom_->data_decoder()->recv(timeoutMs);
+  if (!sres.ok()) return sres.status();
+  return util::Status::OK;
+}
+
+util::Status ESPFlasherClient::parseGreeting(const QByteArray &greeting) {
+  QDataStream gs(greeting);
+  gs.setByteOrder(QDataStream::LittleEndian);
+  quint32 magic = 0;
+  gs >> magic;
+  if (greeting.length() < 4 || magic != STUB_GREETING_MAGIC) {
+    return QS(util::error::INTERNAL,
+              tr("unexpected greeting: %1")
+                  .arg(QString::fromLatin1(greeting.toHex())));
+  }
+  if (greeting.length() >= STUB_GREETING_LEN) {
+    quint32 bufferSize = 0, writeSize = 0;
+    gs >> bufferSize >> writeSize;
+    if (writeSize == 0 || bufferSize < writeSize) {
+      return QS(util::error::INTERNAL,
+                tr("bad greeting: buffer size %1, write size %2")
+                    .arg(bufferSize)
+                    .arg(writeSize));
+    }
+    stubBufferSize_ = bufferSize;
+    stubWriteSize_ = writeSize;
+    extendedStub_ = true;
+  } else {
+    qCritical() << "Flasher stub is out of date (no buffer size in the "
+                   "greeting), compressed and verified writes are disabled. "
+                   "Rebuild stub_flasher.bin from stub_flasher.c.";
+    stubBufferSize_ = legacyStubBufferSize;
+    stubWriteSize_ = legacyStubWriteSize;
+    extendedStub_ = false;
+  }
+  qInfo() << "Connected to flasher, buffer size" << stubBufferSize_
+          << "write size" << stubWriteSize_;
 
   return util::Status::OK;
 }
 
 util::Status ESPFlasherClient::disconnect() {
   if (oldBaudRate_ > 0) {
-    util::Status st = setSpeed(rom_->data_port(), oldBaudRate_);
+    util::Status st = rom_->data_port()->setBaudRate(oldBaudRate_);
     if (st.ok()) oldBaudRate_ = 0;
     return st;
   }
   return util::Status::OK;
 }
 
+util::Status ESPFlasherClient::leaveRunning() {
+  if (!extendedStub_) {
+    return QS(util::error::FAILED_PRECONDITION,
+              tr("stub does not answer pings, it can't be reused"));
+  }
+  QSettings().setValue(residentStubKey(rom_->data_port()),
+                       rom_->data_port()->baudRate());
+  return util::Status::OK;
+}
+
 util::Status ESPFlasherClient::erase(quint32 addr, quint32 size) {
   const QString prefix =
       tr("ESPFlasherClient::erase(0x%1, %2): ").arg(addr, 0, 16).arg(size);
@@ -104,13 +372,13 @@ util::Status ESPFlasherClient::erase(quint32 addr, quint32 size) {
   const int timeoutMs =
       std::max(flashEraseMinTimeoutMs,
                flashBlockEraseTimeMs * (size / flashBlockSize + 1));
-  auto res = SLIP::recv(rom_->data_port(), timeoutMs);
+  auto res = rom_->data_decoder()->recv(timeoutMs);
   if (!res.ok()) return QSP(prefix + "failed to read response", res.status());
   return util::Status::OK;
 }
 
 util::Status ESPFlasherClient::write(quint32 addr, QByteArray data,
-                                     bool erase) {
+                                     bool erase, bool skipBlank) {
   const QString prefix = tr("ESPFlasherClient::write(0x%1, %2, %3): ")
                              .arg(addr, 0, 16)
                              .arg(data.length())
@@ -123,12 +391,15 @@ util::Status ESPFlasherClient::write(quint32 addr, QByteArray data,
   QByteArray args;
   QDataStream s(&args, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
-  s << addr << quint32(data.length()) << quint32(erase);
+  s << addr << quint32(data.length()) << eraseArg(erase, skipBlank);
+  QElapsedTimer rttTimer;
+  rttTimer.start();
   st = SLIP::send(rom_->data_port(), args);
   if (!st.ok()) return QSP(prefix + "arg write failed", st);
-  quint32 numSent = 0, numWritten = 0;
+  quint32 numSent = 0, numWritten = 0, window = 0;
+  int ackTimeoutMs = flashBlockEraseTimeMs;
   while (numWritten < quint32(data.length())) {
-    auto res = SLIP::recv(rom_->data_port(), flashBlockEraseTimeMs);
+    auto res = rom_->data_decoder()->recv(ackTimeoutMs);
     if (!res.ok()) {
       return QSP(prefix + tr("failed to read response @ %1").arg(numWritten),
                  res.status());
@@ -149,17 +420,16 @@ util::Status ESPFlasherClient::write(quint32 addr, QByteArray data,
     s.setByteOrder(QDataStream::LittleEndian);
     s >> numWritten;
     emit progress(numWritten);
-    while (numSent - numWritten <= 5120 && numSent < quint32(data.length())) {
-      quint32 toSend = data.length();
-      if (toSend > 1024) toSend = 1024;
-      qint64 ns = rom_->data_port()->write(data.mid(numSent, toSend));
-      if (ns < 0) {
-        return QSP(prefix + tr("failed to write @ %1").arg(numSent), st);
-      }
-      numSent += ns;
+    if (window == 0) {
+      // First ack is sent by the stub right away, use it to measure latency.
+      const qint64 rttMs = rttTimer.elapsed();
+      window = writeWindow(rttMs);
+      ackTimeoutMs += rttMs;
     }
+    st = fillWriteWindow(data, numWritten, window, &numSent);
+    if (!st.ok()) return QSP(prefix + "data write failed", st);
   }
-  auto hres = SLIP::recv(rom_->data_port());
+  auto hres = rom_->data_decoder()->recv();
   if (!hres.ok()) {
     return QSP(prefix + "digest read failed", hres.status());
   }
@@ -173,7 +443,7 @@ util::Status ESPFlasherClient::write(quint32 addr, QByteArray data,
                       .arg(QString::fromLatin1(expHash.toHex()))
                       .arg(QString::fromLatin1(hash.toHex())));
   }
-  auto res = SLIP::recv(rom_->data_port());
+  auto res = rom_->data_decoder()->recv();
   if (!res.ok()) {
     return QSP(prefix + tr("failed to read response @ %1").arg(numWritten),
                res.status());
@@ -193,26 +463,221 @@ util::Status ESPFlasherClient::write(quint32 addr, QByteArray data,
   return util::Status::OK;
 }
 
-util::StatusOr<QByteArray> ESPFlasherClient::read(quint32 addr, quint32 size) {
+util::Status ESPFlasherClient::writeDeflated(quint32 addr,
+                                             const QByteArray &data,
+                                             bool erase, bool skipBlank) {
+  if (!extendedStub_) {
+    qWarning() << "Stub does not support compression, writing as is";
+    return write(addr, data, erase, skipBlank);
+  }
+  size_t deflatedLen = 0;
+  void *deflated = tdefl_compress_mem_to_heap(
+      data.constData(), data.length(), &deflatedLen, TDEFL_DEFAULT_MAX_PROBES);
+  if (deflated == nullptr) {
+    return QS(util::error::INTERNAL,
+              tr("failed to compress %1 @ 0x%2")
+                  .arg(data.length())
+                  .arg(addr, 0, 16));
+  }
+  const QByteArray deflatedData((const char *) deflated, deflatedLen);
+  mz_free(deflated);
+  qInfo() << data.length() << "bytes deflated to" << deflatedLen;
+  return writeDeflatedStream(
+      addr, data.length(), deflatedData,
+      QCryptographicHash::hash(data, QCryptographicHash::Md5), erase,
+      skipBlank);
+}
+
+util::Status ESPFlasherClient::writeDeflatedStream(quint32 addr, quint32 size,
+                                                   const QByteArray &deflated,
+                                                   const QByteArray &md5,
+                                                   bool erase, bool skipBlank) {
   const QString prefix =
-      tr("ESPFlasherClient::read(0x%1, %2): ").arg(addr, 0, 16).arg(size);
+      tr("ESPFlasherClient::writeDeflatedStream(0x%1, %2, %3, %4): ")
+          .arg(addr, 0, 16)
+          .arg(size)
+          .arg(deflated.length())
+          .arg(erase);
   qDebug() << prefix;
+  if (!extendedStub_) {
+    return QS(util::error::FAILED_PRECONDITION,
+              prefix + "stub does not support compression");
+  }
+  util::Status st =
+      SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_WRITE_DEFLATED));
+  if (!st.ok()) return QSP(prefix + "command write failed", st);
+  QByteArray args;
+  QDataStream s(&args, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s << addr << size << eraseArg(erase, skipBlank)
+    << quint32(deflated.length());
+  QElapsedTimer rttTimer;
+  rttTimer.start();
+  st = SLIP::send(rom_->data_port(), args);
+  if (!st.ok()) return QSP(prefix + "arg write failed", st);
+  quint32 numSent = 0, numConsumed = 0, numWritten = 0, window = 0;
+  int ackTimeoutMs = flashBlockEraseTimeMs;
+  while (numWritten < size) {
+    auto res = rom_->data_decoder()->recv(ackTimeoutMs);
+    if (!res.ok()) {
+      return QSP(prefix + tr("failed to read response @ %1").arg(numWritten),
+                 res.status());
+    }
+    QByteArray respBytes = res.ValueOrDie();
+    if (respBytes.length() == 1) {
+      return QS(util::error::UNAVAILABLE,
+                prefix +
+                    tr("failed to write, code: %1")
+                        .arg(QString::fromLatin1(respBytes.toHex())));
+    }
+    if (respBytes.length() != 8) {
+      return QS(
+          util::error::INTERNAL,
+          prefix + tr("expected 8 bytes, got %1").arg(respBytes.length()));
+    }
+    QDataStream s(respBytes);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s >> numConsumed >> numWritten;
+    emit progress(numWritten);
+    if (window == 0) {
+      const qint64 rttMs = rttTimer.elapsed();
+      window = writeWindow(rttMs);
+      ackTimeoutMs += rttMs;
+    }
+    st = fillWriteWindow(deflated, numConsumed, window, &numSent);
+    if (!st.ok()) return QSP(prefix + "data write failed", st);
+  }
+  // Stub may finish writing before it sees the end of the stream, it will
+  // still want the rest of it.
+  st = fillWriteWindow(deflated, numSent, deflated.length(), &numSent);
+  if (!st.ok()) return QSP(prefix + "data write failed", st);
+  auto hres = rom_->data_decoder()->recv();
+  if (!hres.ok()) {
+    return QSP(prefix + "digest read failed", hres.status());
+  }
+  const QByteArray &devHash = hres.ValueOrDie();
+  if (md5 != devHash) {
+    return QS(util::error::DATA_LOSS,
+              prefix +
+                  tr("hash mismatch: expected %1, got %2")
+                      .arg(QString::fromLatin1(md5.toHex()))
+                      .arg(QString::fromLatin1(devHash.toHex())));
+  }
+  auto res = rom_->data_decoder()->recv();
+  if (!res.ok()) {
+    return QSP(prefix + tr("failed to read response @ %1").arg(numWritten),
+               res.status());
+  }
+  QByteArray respBytes = res.ValueOrDie();
+  if (respBytes.length() != 1) {
+    return QS(util::error::INTERNAL,
+              prefix + tr("expected 1 byte, got %1").arg(respBytes.length()));
+  }
+  if (respBytes[0] != '\x00') {
+    return QS(util::error::UNAVAILABLE,
+              prefix +
+                  tr("bad final response, %1")
+                      .arg(QString::fromLatin1(respBytes.toHex())));
+  }
+
+  return util::Status::OK;
+}
+
+bool ESPFlasherClient::deflateSupported() const {
+  return extendedStub_;
+}
+
+qint32 ESPFlasherClient::baudRate() const {
+  return rom_->data_port()->baudRate();
+}
+
+bool ESPFlasherClient::verifiesWrites() const {
+  return extendedStub_;
+}
+
+quint32 ESPFlasherClient::writeWindow(qint64 ackRttMs) const {
+  // Amount of data the line can carry while we wait for an ack.
+  const quint64 bdp =
+      quint64(rom_->data_port()->baudRate()) / 10 * ackRttMs / 1000;
+  // On top of that the stub needs a chunk to write while the next one
+  // arrives, but no more: anything extra just sits in its buffer and delays
+  // the error response if a write fails. Stub's receive buffer is the limit.
+  // Acks only ever lag behind actual consumption, so filling it up to the
+  // acked position is safe.
+  const quint32 window = quint32(
+      std::min(std::max(bdp + stubWriteSize_, 2 * quint64(stubWriteSize_)),
+               quint64(stubBufferSize_)));
+  qDebug() << "Ack RTT" << ackRttMs << "ms, BDP" << bdp << "window" << window;
+  if (bdp + stubWriteSize_ > window) {
+    qWarning() << "Write window" << window << "is smaller than BDP" << bdp
+               << "+ write size, write speed will be limited by latency";
+  }
+  return window;
+}
+
+util::Status ESPFlasherClient::fillWriteWindow(const QByteArray &data,
+                                               quint32 numAcked, quint32 window,
+                                               quint32 *numSent) {
+  const quint32 limit = std::min(quint32(data.length()), numAcked + window);
+  if (*numSent >= limit) return util::Status::OK;
+  // Send everything the window allows in one go.
+  qint64 ns =
+      rom_->data_port()->write(data.constData() + *numSent, limit - *numSent);
+  if (ns < 0) {
+    return QS(util::error::UNAVAILABLE,
+              tr("failed to write @ %1: %2")
+                  .arg(*numSent)
+                  .arg(rom_->data_port()->errorString()));
+  }
+  *numSent += ns;
+  return util::Status::OK;
+}
+
+util::StatusOr<QByteArray> ESPFlasherClient::read(quint32 addr, quint32 size,
+                                                   quint32 blockSize) {
+  const QString prefix = tr("ESPFlasherClient::read(0x%1, %2, %3): ")
+                             .arg(addr, 0, 16)
+                             .arg(size)
+                             .arg(blockSize);
+  qDebug() << prefix;
+  if (blockSize == 0 || blockSize > kFlashSectorSize) {
+    return QS(util::error::INVALID_ARGUMENT,
+              prefix + tr("block size must be between 1 and %1")
+                           .arg(kFlashSectorSize));
+  }
   util::Status st = SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_READ));
   if (!st.ok()) return QSP(prefix + "command write failed", st);
   QByteArray args;
   QDataStream s(&args, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
-  s << addr << size << flashReadBlockSize;
+  s << addr << size << blockSize << blockSize * flashReadBlocksInFlight;
   st = SLIP::send(rom_->data_port(), args);
   if (!st.ok()) return QSP(prefix + "arg write failed", st);
   QByteArray data;
+  data.reserve(size);
   while (quint32(data.length()) < size) {
-    auto bres = SLIP::recv(rom_->data_port());
+    auto bres = rom_->data_decoder()->recv();
     if (!bres.ok()) {
-      return QSP(prefix + tr("data read failed @ %3").arg(data.length()),
+      return QSP(prefix + tr("data read failed @ %1").arg(data.length()),
                  bres.status());
     }
-    data.append(bres.ValueOrDie());
+    const QByteArray &block = bres.ValueOrDie();
+    if (block.length() == 1) {
+      return QS(util::error::UNAVAILABLE,
+                prefix + tr("failed to read @ %1, code: %2")
+                             .arg(data.length())
+                             .arg(QString::fromLatin1(block.toHex())));
+    }
+    data.append(block);
+    // Acks are cumulative, stub keeps sending while it's within the window.
+    QByteArray ack;
+    QDataStream as(&ack, QIODevice::WriteOnly);
+    as.setByteOrder(QDataStream::LittleEndian);
+    as << quint32(data.length());
+    st = SLIP::send(rom_->data_port(), ack);
+    if (!st.ok()) {
+      return QSP(prefix + tr("ack write failed @ %1").arg(data.length()), st);
+    }
     emit progress(data.length());
   }
   if (quint32(data.length()) > size) {
@@ -220,7 +685,7 @@ util::StatusOr<QByteArray> ESPFlasherClient::read(quint32 addr, quint32 size) {
         util::error::INTERNAL,
         prefix + tr("expected %3 bytes, got %4").arg(size).arg(data.length()));
   }
-  auto hres = SLIP::recv(rom_->data_port());
+  auto hres = rom_->data_decoder()->recv();
   if (!hres.ok()) {
     return QSP(prefix + "digest read failed", hres.status());
   }
@@ -234,7 +699,7 @@ util::StatusOr<QByteArray> ESPFlasherClient::read(quint32 addr, quint32 size) {
                       .arg(QString::fromLatin1(expHash.toHex()))
                       .arg(QString::fromLatin1(hash.toHex())));
   }
-  auto sres = SLIP::recv(rom_->data_port());
+  auto sres = rom_->data_decoder()->recv();
   if (!sres.ok()) {
     return QSP(prefix + tr("failed to read status"), sres.status());
   }
@@ -261,7 +726,7 @@ util::StatusOr<ESPFlasherClient::DigestResult> ESPFlasherClient::digest(
   while (true) {
     int timeoutMs = flashBlockReadWriteTimeMs *
                     (digestBlockSize > 0 ? 10 : (size / flashBlockSize + 1));
-    auto res = SLIP::recv(rom_->data_port(), timeoutMs);
+    auto res = rom_->data_decoder()->recv(timeoutMs);
     if (!res.ok()) return QSP(prefix + "read failed", res.status());
     QByteArray r = res.ValueOrDie();
     switch (r.length()) {
@@ -284,13 +749,73 @@ util::StatusOr<ESPFlasherClient::DigestResult> ESPFlasherClient::digest(
   // Not reached.
 }
 
+util::StatusOr<QVector<bool>> ESPFlasherClient::sectorDiff(
+    const QVector<SectorDigest> &sectors) {
+  const QString prefix =
+      tr("ESPFlasherClient::sectorDiff(%1): ").arg(sectors.size());
+  qDebug() << prefix;
+  if (!extendedStub_) {
+    return QS(util::error::UNIMPLEMENTED, prefix + "not supported by the stub");
+  }
+  QVector<bool> result;
+  result.reserve(sectors.size());
+  for (int start = 0; start < sectors.size(); start += maxDiffSectors) {
+    const int n = std::min(sectors.size() - start, maxDiffSectors);
+    util::Status st =
+        SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_SECTOR_DIFF));
+    if (!st.ok()) return QSP(prefix + "command write failed", st);
+    QByteArray args;
+    QDataStream s(&args, QIODevice::WriteOnly);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s << quint32(n);
+    st = SLIP::send(rom_->data_port(), args);
+    if (!st.ok()) return QSP(prefix + "arg write failed", st);
+    QByteArray req;
+    QDataStream rs(&req, QIODevice::WriteOnly);
+    rs.setByteOrder(QDataStream::LittleEndian);
+    for (int i = start; i < start + n; i++) {
+      const SectorDigest &sd = sectors[i];
+      if (sd.len > kFlashSectorSize || sd.digest.length() != 16) {
+        return QS(util::error::INVALID_ARGUMENT,
+                  prefix + tr("invalid region %1 @ 0x%2")
+                               .arg(sd.len)
+                               .arg(sd.addr, 0, 16));
+      }
+      rs << sd.addr << sd.len;
+      rs.writeRawData(sd.digest.constData(), sd.digest.length());
+    }
+    st = SLIP::send(rom_->data_port(), req);
+    if (!st.ok()) return QSP(prefix + "request write failed", st);
+    auto res = rom_->data_decoder()->recv(sectorDiffTimeMs * n +
+                                          flashBlockReadWriteTimeMs);
+    if (!res.ok()) return QSP(prefix + "read failed", res.status());
+    const QByteArray &bitmap = res.ValueOrDie();
+    if (bitmap.length() != (n + 31) / 32 * 4) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("unexpected response: %1")
+                             .arg(QString::fromLatin1(bitmap.toHex())));
+    }
+    for (int i = 0; i < n; i++) {
+      result.append((quint8(bitmap[i / 8]) >> (i % 8)) & 1);
+    }
+    auto sres = rom_->data_decoder()->recv();
+    if (!sres.ok()) return QSP(prefix + "failed to read status", sres.status());
+    if (sres.ValueOrDie() != QByteArray(1, 0)) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("error: %1").arg(QString::fromLatin1(
+                             sres.ValueOrDie().toHex())));
+    }
+  }
+  return result;
+}
+
 util::StatusOr<quint32> ESPFlasherClient::getFlashChipID() {
   const QString prefix = tr("ESPFlasherClient::getFlashChipID(): ");
   qDebug() << prefix;
   util::Status st =
       SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_READ_CHIP_ID));
   if (!st.ok()) return QSP(prefix + "command write failed", st);
-  auto res = SLIP::recv(rom_->data_port(), 1000);
+  auto res = rom_->data_decoder()->recv(1000);
   if (!res.ok()) return QSP(prefix + "failed to read result", res.status());
   quint32 chipID = 0;
   QByteArray respBytes = res.ValueOrDie();
@@ -303,18 +828,63 @@ util::StatusOr<quint32> ESPFlasherClient::getFlashChipID() {
   if (chipID == 0) {
     return QS(util::error::INTERNAL, prefix + "0 is not a valid chip ID");
   }
-  res = SLIP::recv(rom_->data_port());
+  res = rom_->data_decoder()->recv();
   if (!res.ok()) return QSP(prefix + "failed to read status", res.status());
   return chipID;
 }
 
+util::StatusOr<quint32> ESPFlasherClient::readRegister(quint32 addr) {
+  const QString prefix =
+      tr("ESPFlasherClient::readRegister(0x%1): ").arg(addr, 0, 16);
+  qDebug() << prefix;
+  if (!extendedStub_) {
+    return QS(util::error::UNIMPLEMENTED, prefix + "not supported by the stub");
+  }
+  util::Status st = SLIP::send(rom_->data_port(), cmdByte(CMD_READ_REG));
+  if (!st.ok()) return QSP(prefix + "command write failed", st);
+  QByteArray args;
+  QDataStream as(&args, QIODevice::WriteOnly);
+  as.setByteOrder(QDataStream::LittleEndian);
+  as << addr;
+  st = SLIP::send(rom_->data_port(), args);
+  if (!st.ok()) return QSP(prefix + "arg write failed", st);
+  auto res = rom_->data_decoder()->recv(1000);
+  if (!res.ok()) return QSP(prefix + "failed to read result", res.status());
+  const QByteArray &respBytes = res.ValueOrDie();
+  if (respBytes.length() == 1) {
+    // Error code instead of the value.
+    return QS(util::error::UNIMPLEMENTED,
+              prefix + tr("failed, code: %1")
+                           .arg(QString::fromLatin1(respBytes.toHex())));
+  }
+  if (respBytes.length() != 4) {
+    return QS(util::error::INTERNAL,
+              prefix + tr("invalid result length: %1").arg(respBytes.length()));
+  }
+  quint32 value = 0;
+  QDataStream s(respBytes);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s >> value;
+  res = rom_->data_decoder()->recv();
+  if (!res.ok()) return QSP(prefix + "failed to read status", res.status());
+  return value;
+}
+
+util::StatusOr<QByteArray> ESPFlasherClient::readMAC() {
+  auto mac0 = readRegister(ESPROMClient::kMAC0Register);
+  if (!mac0.ok()) return mac0.status();
+  auto mac1 = readRegister(ESPROMClient::kMAC1Register);
+  if (!mac1.ok()) return mac1.status();
+  return ESPROMClient::macFromRegisters(mac0.ValueOrDie(), mac1.ValueOrDie());
+}
+
 util::Status ESPFlasherClient::simpleCmd(enum stub_cmd cmd, const QString &name,
                                          int timeoutMs) {
   const QString prefix = QString("ESPFlasherClient::%1()").arg(name);
   qDebug() << prefix;
   util::Status st = SLIP::send(rom_->data_port(), cmdByte(cmd));
   if (!st.ok()) return QSP(prefix + tr(": command write failed"), st);
-  auto res = SLIP::recv(rom_->data_port(), timeoutMs);
+  auto res = rom_->data_decoder()->recv(timeoutMs);
   if (!st.ok()) return QSP(prefix + tr(": failed to read response"), st);
   return util::Status::OK;
 }
@@ -324,9 +894,11 @@ util::Status ESPFlasherClient::eraseChip() {
 }
 
 util::Status ESPFlasherClient::bootFirmware() {
+  QSettings().remove(residentStubKey(rom_->data_port()));
   return simpleCmd(CMD_BOOT_FW, "bootFirmware", 200);
 }
 
 util::Status ESPFlasherClient::reboot() {
+  QSettings().remove(residentStubKey(rom_->data_port()));
   return simpleCmd(CMD_REBOOT, "reboot", 200);
 }
@@ -7,7 +7,6 @@
 #define CS_MFT_SRC_ESP_FLASHER_CLIENT_H_
 
 #include <QObject>
-#include <QSerialPort>
 
 #include "esp_rom_client.h"
 
@@ -22,23 +21,74 @@ class ESPFlasherClient : public QObject {
   static const quint32 kFlashSectorSize;
   static const quint32 kFlashBlockSize;
 
-  // Load the flasher stub.
-  util::Status connect(qint32 baudRate);
+  // Load the flasher stub. If ROM client is not connected yet, first tries
+  // to reuse the stub left running on the port, then connects to the ROM.
+  // If autoBaudRate is set, picks the fastest baud rate that works instead,
+  // unless the stub can't change it: then it runs at baudRate.
+  util::Status connect(qint32 baudRate, bool autoBaudRate = false);
+
+  // Connect to a stub left running by a previous session, at the baud rate it
+  // was last used with. Does not reset the device.
+  util::Status connectResident();
+
+  // Switch stub and host to a different baud rate, checking that data gets
+  // through intact. If it doesn't, both stay at the current rate.
+  util::Status setBaudRate(qint32 baudRate);
+
+  // Steps through increasing baud rates while they work.
+  // Returns the rate in use when done.
+  util::StatusOr<qint32> negotiateBaudRate();
+
+  // Next rate down the ladder used by negotiateBaudRate, 0 if none.
+  static qint32 lowerBaudRate(qint32 baudRate);
 
   // Disconnect from the flasher stub. The stub stays running.
   util::Status disconnect();
 
+  // Records that the stub is left running on the port, so that
+  // connectResident can pick it up in a later session. Only stubs that
+  // answer pings can be picked up this way.
+  util::Status leaveRunning();
+
   // Erase a region of SPI flash.
   // Address and size must be aligned to flash sector size.
   util::Status erase(quint32 addr, quint32 size);
 
   // Write a region of SPI flash. Performs erase before writing.
   // Address and size must be aligned to flash sector size.
-  util::Status write(quint32 addr, QByteArray data, bool erase);
+  // If skipBlank is set, the stub does not erase sectors that are already
+  // blank.
+  util::Status write(quint32 addr, QByteArray data, bool erase,
+                     bool skipBlank = false);
+
+  // Same as write, but data is deflated before sending and inflated by the
+  // stub. Much faster for images with lots of padding and empty space.
+  // Falls back to write if the stub does not support compression.
+  util::Status writeDeflated(quint32 addr, const QByteArray &data, bool erase,
+                             bool skipBlank = false);
+
+  // Whether the stub supports compressed writes.
+  bool deflateSupported() const;
+
+  // Baud rate the stub is talking at.
+  qint32 baudRate() const;
+
+  // Whether the stub reads data back after writing, in which case the digest
+  // returned by writes reflects actual flash contents.
+  bool verifiesWrites() const;
+
+  // Write a raw deflate stream that inflates to size bytes (zero-padded to
+  // size if shorter), md5 is the digest of the inflated and padded data.
+  util::Status writeDeflatedStream(quint32 addr, quint32 size,
+                                   const QByteArray &deflated,
+                                   const QByteArray &md5, bool erase,
+                                   bool skipBlank = false);
 
   // Read a region of SPI flash.
-  // No special alignment requirements.
-  util::StatusOr<QByteArray> read(quint32 addr, quint32 size);
+  // No special alignment requirements, blockSize must not exceed
+  // kFlashSectorSize. Larger blocks are faster.
+  util::StatusOr<QByteArray> read(quint32 addr, quint32 size,
+                                  quint32 blockSize = kFlashSectorSize);
 
   // Compute MD5 digest of SPI flash contents.
   // No special alignment requirements.
@@ -49,8 +99,26 @@ class ESPFlasherClient : public QObject {
   util::StatusOr<DigestResult> digest(quint32 addr, quint32 size,
                                       quint32 digestBlockSize);
 
+  // Compare regions of SPI flash with expected MD5 digests, many regions
+  // per round trip. Region size must not exceed kFlashSectorSize.
+  // Returns true for each region that differs.
+  typedef struct {
+    quint32 addr;
+    quint32 len;
+    QByteArray digest;
+  } SectorDigest;
+  util::StatusOr<QVector<bool>> sectorDiff(
+      const QVector<SectorDigest> &sectors);
+
   util::StatusOr<quint32> getFlashChipID();
 
+  // Read a 32-bit register via the stub.
+  util::StatusOr<quint32> readRegister(quint32 addr);
+
+  // Same as ESPROMClient::readMAC, but via the stub, e.g. when it was left
+  // running and the ROM loader is not available.
+  util::StatusOr<QByteArray> readMAC();
+
   util::Status eraseChip();
 
   util::Status bootFirmware();
@@ -62,9 +130,25 @@ signals:
 
  private:
   util::Status simpleCmd(enum stub_cmd cmd, const QString &name, int timeoutMs);
+  // Runs the stub at baudRate (0 to keep the current one) and reads the
+  // greeting.
+  util::Status startStub(qint32 baudRate);
+  util::Status parseGreeting(const QByteArray &greeting);
+  util::Status ping(int timeoutMs);
+  // Returns the number of bytes that can be in flight during a write.
+  quint32 writeWindow(qint64 ackRttMs) const;
+  // Sends as much of data as the window allows, advancing numSent.
+  util::Status fillWriteWindow(const QByteArray &data, quint32 numAcked,
+                               quint32 window, quint32 *numSent);
 
   ESPROMClient *rom_;  // Not owned.
   qint32 oldBaudRate_ = 0;
+  // Reported by the stub in the greeting.
+  quint32 stubBufferSize_ = 0;
+  quint32 stubWriteSize_ = 0;
+  // Stub reports buffer sizes in the greeting, supports compressed and
+  // verified writes and sector diff.
+  bool extendedStub_ = false;
 };
 
 #endif /* CS_MFT_SRC_ESP_FLASHER_CLIENT_H_ */
@@ -1,9 +1,13 @@
 #include "esp_rom_client.h"
 
+#include <string.h>
+
+#include <algorithm>
+
 #include <QDataStream>
-#include <QJsonDocument>
-#include <QJsonObject>
+#include <QSettings>
 #include <QtDebug>
+#include <QtEndian>
 #include <QThread>
 
 #include "slip.h"
@@ -16,57 +20,120 @@
 namespace {
 
 const int numConnectAttempts = 4;
-const int memWriteBlockSize = 4096;
+// Boot ROM prints a banner (at 74880) when it starts. It is done with the
+// boot mode pins and ready for sync once the line goes quiet.
+const int kBannerQuietMs = 20;
+// How long to wait for the banner if it was not seen before.
+const int kMaxBannerMs = 250;
+// Learned banner time is padded by this much on the first attempt.
+const int kBannerMarginMs = 50;
+const int kSyncAttempts = 3;
+const int kSyncTimeoutMs = 100;
+// Register reads sent ahead of responses. Requests are small, this many
+// comfortably fit in the ROM's UART FIFO.
+const int kRegisterReadsInFlight = 4;
+// Largest block the ROM accepts for memory writes.
+const int memWriteBlockSize = 0x1800;
+// Number of memory write blocks sent ahead of responses. The ROM receives
+// the next block while the response to the previous one travels back, so
+// the line does not sit idle for a round trip per block. Not measured;
+// further blocks would only queue in the host and adapter buffers.
+const int kMemWriteBlocksInFlight = 2;
+
+// Command header: direction, command, argument size, checksum.
+const int kHeaderSize = 8;
+// Header and the data write block arguments that precede the payload.
+const int kMaxFrameOverhead = kHeaderSize + 4 * 4;
+// Stub image header: magic and 7 words.
+const int kStubHeaderSize = 32;
+
+QString resetStrategyKey(const Transport *port) {
+  QString id = port->adapterId();
+  id.replace('/', '_');
+  return QString("esp8266/resetStrategy/%1").arg(id);
+}
 
 }  // namespace
 
-ESPROMClient::ESPROMClient(QSerialPort *control_port, QSerialPort *data_port)
-    : control_port_(control_port), data_port_(data_port) {
+ESPROMClient::ESPROMClient(Transport *control_port, Transport *data_port)
+    : control_port_(control_port),
+      data_port_(data_port),
+      decoder_(SLIP::Decoder::forPort(data_port)) {
+  // Large enough for a memory write block, so the buffers are allocated once.
+  frame_.reserve(kMaxFrameOverhead + memWriteBlockSize);
+  encodedFrame_.reserve(2 * (kMaxFrameOverhead + memWriteBlockSize) + 2);
+  // Responses are read and decoded on the I/O thread while we are talking to
+  // the device, if the port supports it.
+  util::Status st = decoder_->startAsync();
+  if (!st.ok()) qDebug() << "Reading synchronously:" << st;
 }
 
 ESPROMClient::~ESPROMClient() {
+  decoder_->stopAsync();
 }
 
 bool ESPROMClient::connected() const {
   return connected_;
 }
 
-QSerialPort *ESPROMClient::control_port() {
+Transport *ESPROMClient::control_port() {
   return control_port_;
 }
 
-QSerialPort *ESPROMClient::data_port() {
+Transport *ESPROMClient::data_port() {
   return data_port_;
 }
 
+SLIP::Decoder *ESPROMClient::data_decoder() {
+  return decoder_;
+}
+
 util::Status ESPROMClient::connect() {
   qInfo() << "ESPROMClient::connect(): control port"
           << control_port_->portName() << "data port" << data_port_->portName();
   connected_ = false;
   // This targets the NodeMCU flip-flop-like circuit but will also work with
   // direct DTR -> GPIO0, RTS -> RST connections.
+  // Start with whatever worked for this adapter last time.
+  QSettings settings;
+  const QString key = resetStrategyKey(control_port_);
+  inverted_ = settings.value(key + "/inverted", inverted_).toBool();
+  const int learnedBannerMs = settings.value(key + "/bannerMs", -1).toInt();
   util::Status r;
   for (int i = 0; i < numConnectAttempts; i++) {
     qDebug() << "Connect attempt" << (i + 1) << "inverted?" << inverted_;
-    control_port_->setDataTerminalReady(false ^ inverted_);
-    control_port_->setRequestToSend(true ^ inverted_);
-    QThread::msleep(10);
-    control_port_->setDataTerminalReady(true ^ inverted_);
-    control_port_->setRequestToSend(false ^ inverted_);
-    QThread::msleep(250);
-    control_port_->setDataTerminalReady(false ^ inverted_);
-    control_port_->setRequestToSend(false ^ inverted_);
+    const int maxBannerMs = (i == 0 && learnedBannerMs >= 0)
+                                ? learnedBannerMs + kBannerMarginMs
+                                : kMaxBannerMs;
+    const int bannerMs = resetIntoBootLoader(maxBannerMs);
     r = sync();
     if (r.ok()) {
-      qInfo() << "ESPROMClient connected, inverted?" << inverted_;
+      qInfo() << "ESPROMClient connected, inverted?" << inverted_
+              << "banner ms:" << bannerMs;
+      settings.setValue(key + "/inverted", inverted_);
+      if (bannerMs >= 0) settings.setValue(key + "/bannerMs", bannerMs);
       connected_ = true;
       return util::Status::OK;
     }
-    inverted_ = (i % 2 == 0);
+    inverted_ = !inverted_;
   }
   return QSP("ESPROMClient::connect()", r);
 }
 
+int ESPROMClient::resetIntoBootLoader(int maxBannerMs) {
+  control_port_->setDataTerminalReady(false ^ inverted_);
+  control_port_->setRequestToSend(true ^ inverted_);
+  QThread::msleep(10);
+  control_port_->setDataTerminalReady(true ^ inverted_);
+  control_port_->setRequestToSend(false ^ inverted_);
+  // Keep GPIO0 down until the ROM has started, which it tells us by
+  // printing the banner.
+  const int bannerMs = decoder_->waitForQuiet(kBannerQuietMs, maxBannerMs);
+  control_port_->setDataTerminalReady(false ^ inverted_);
+  control_port_->setRequestToSend(false ^ inverted_);
+  return bannerMs;
+}
+
 util::Status ESPROMClient::rebootIntoFirmware() {
   control_port_->setDataTerminalReady(false ^ inverted_);  // pull up GPIO0
   control_port_->setRequestToSend(true ^ inverted_);       // pull down RESET
@@ -77,17 +144,21 @@ util::Status ESPROMClient::rebootIntoFirmware() {
 }
 
 util::Status ESPROMClient::sync() {
-  QByteArray arg("\x07\x07\x12\x20");
-  arg.append(QByteArray("U").repeated(32));
-  command(Command::Sync, arg);
-  auto cs = command(Command::Sync, arg, 100);
+  static const QByteArray arg =
+      QByteArray("\x07\x07\x12\x20") + QByteArray("U").repeated(32);
+  // ROM may need a few attempts to detect the baud rate, but it answers
+  // quickly once it has.
+  util::StatusOr<Response> cs;
+  for (int i = 0; i < kSyncAttempts; i++) {
+    cs = command(Command::Sync, {}, arg, 0, kSyncTimeoutMs);
+    if (cs.ok()) break;
+  }
   if (!cs.ok()) return cs.status();
-  util::StatusOr<QByteArray> s;
+  // Every sync is answered 8 times, drain the rest.
   for (int i = 0; i < 7; i++) {
-    s = SLIP::recv(data_port_);
-    if (!s.ok()) break;
+    if (!decoder_->recv(kSyncTimeoutMs).ok()) break;
   }
-  return s.status();
+  return util::Status::OK;
 }
 
 util::Status ESPROMClient::memWriteStart(quint32 size, quint32 numBlocks,
@@ -100,35 +171,25 @@ util::Status ESPROMClient::memWriteStart(quint32 size, quint32 numBlocks,
                   .arg(numBlocks)
                   .arg(blockSize)
                   .arg(addr, 0, 16);
-  QByteArray arg;
-  QDataStream s(&arg, QIODevice::WriteOnly);
-  s.setByteOrder(QDataStream::LittleEndian);
-  s << size << numBlocks << blockSize << addr;
-  return command(Command::MemWriteStart, arg).status();
+  return command(Command::MemWriteStart, {size, numBlocks, blockSize, addr})
+      .status();
 }
 
 util::Status ESPROMClient::memWriteBlock(quint32 seq, const QByteArray &data) {
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
-  QByteArray arg;
-  QDataStream s(&arg, QIODevice::WriteOnly);
-  s.setByteOrder(QDataStream::LittleEndian);
-  s << quint32(data.length()) << seq << quint32(0) << quint32(0);
-  arg.append(data);
-  return command(Command::MemWriteBlock, arg, checksum(data)).status();
+  return command(Command::MemWriteBlock,
+                 {quint32(data.length()), seq, 0, 0}, data, checksum(data))
+      .status();
 }
 
 util::Status ESPROMClient::memWriteFinish(quint32 jumpAddr) {
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
-  QByteArray arg;
-  QDataStream s(&arg, QIODevice::WriteOnly);
-  s.setByteOrder(QDataStream::LittleEndian);
   quint32 noJump = (jumpAddr == 0);
-  s << noJump << jumpAddr;
-  return command(Command::MemWriteFinish, arg).status();
+  return command(Command::MemWriteFinish, {noJump, jumpAddr}).status();
 }
 
 util::Status ESPROMClient::flashWriteStart(quint32 addr, quint32 size,
@@ -136,16 +197,14 @@ util::Status ESPROMClient::flashWriteStart(quint32 addr, quint32 size,
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
-  QByteArray arg;
-  QDataStream s(&arg, QIODevice::WriteOnly);
   quint32 numBlocks =
       writeBlockSize > 0 ? ((size + writeBlockSize - 1) / writeBlockSize) : 0;
-  s.setByteOrder(QDataStream::LittleEndian);
   qInfo() << "Flash start: " << hex << showbase << addr << dec << size
           << numBlocks << writeBlockSize;
-  s << size << numBlocks << writeBlockSize << addr;
-  return checkStatus(command(Command::FlashWriteStart, arg, 0, true, 10000),
-                     "flashWriteStart");
+  return checkStatus(
+      command(Command::FlashWriteStart,
+              {size, numBlocks, writeBlockSize, addr}, QByteArray(), 0, 10000),
+      "flashWriteStart");
 }
 
 util::Status ESPROMClient::flashWriteBlock(quint32 seq,
@@ -153,25 +212,17 @@ util::Status ESPROMClient::flashWriteBlock(quint32 seq,
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
-  QByteArray arg;
-  QDataStream s(&arg, QIODevice::WriteOnly);
-  s.setByteOrder(QDataStream::LittleEndian);
-  s << quint32(data.length()) << seq << quint32(0) << quint32(0);
-  arg.append(data);
-  return checkStatus(
-      command(Command::FlashWriteBlock, arg, checksum(data), true, 10000),
-      "flashWriteBlock");
+  return checkStatus(command(Command::FlashWriteBlock,
+                             {quint32(data.length()), seq, 0, 0}, data,
+                             checksum(data), 10000),
+                     "flashWriteBlock");
 }
 
 util::Status ESPROMClient::flashWriteFinish(bool reboot) {
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
-  QByteArray arg;
-  QDataStream s(&arg, QIODevice::WriteOnly);
-  s.setByteOrder(QDataStream::LittleEndian);
-  s << quint32(!reboot);
-  return checkStatus(command(Command::FlashWriteFinish, arg),
+  return checkStatus(command(Command::FlashWriteFinish, {quint32(!reboot)}),
                      "flashWriteFinish");
 }
 
@@ -179,26 +230,53 @@ util::StatusOr<quint32> ESPROMClient::readRegister(quint32 addr) {
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
-  QByteArray arg;
-  QDataStream s(&arg, QIODevice::WriteOnly);
-  s.setByteOrder(QDataStream::LittleEndian);
-  s << addr;
-  auto resp = command(Command::ReadRegister, arg);
+  auto resp = command(Command::ReadRegister, {addr});
   auto rs = checkStatus(resp, "readRegister");
   if (!rs.ok()) return rs;
   return resp.ValueOrDie().value;
 }
 
+util::StatusOr<QVector<quint32>> ESPROMClient::readRegisters(
+    const QVector<quint32> &addrs) {
+  if (!connected_) {
+    return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
+  }
+  QVector<quint32> values;
+  values.reserve(addrs.size());
+  decoder_->flush();
+  // Responses come back in order, keep a few requests ahead of them.
+  for (int sent = 0; values.size() < addrs.size();) {
+    if (sent < addrs.size() && sent - values.size() < kRegisterReadsInFlight) {
+      util::Status st =
+          sendCommand(Command::ReadRegister, {addrs[sent]}, QByteArray(), 0);
+      if (!st.ok()) return st;
+      sent++;
+      continue;
+    }
+    auto resp = recvResponse(Command::ReadRegister);
+    util::Status st = checkStatus(resp, "readRegister");
+    if (!st.ok()) return st;
+    values.append(resp.ValueOrDie().value);
+  }
+  return values;
+}
+
+const quint32 ESPROMClient::kMAC0Register = 0x3ff00050;
+const quint32 ESPROMClient::kMAC1Register = 0x3ff00054;
+
 util::StatusOr<QByteArray> ESPROMClient::readMAC() {
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
+  auto rs = readRegisters({kMAC0Register, kMAC1Register});
+  if (!rs.ok()) return rs.status();
+  return macFromRegisters(rs.ValueOrDie()[0], rs.ValueOrDie()[1]);
+}
+
+// static
+util::StatusOr<QByteArray> ESPROMClient::macFromRegisters(quint32 mac0,
+                                                          quint32 mac1) {
   QByteArray mac;
-  auto mac0rs = readRegister(0x3ff00050);
-  if (!mac0rs.ok()) return mac0rs.status();
-  auto mac1rs = readRegister(0x3ff00054);
-  if (!mac1rs.ok()) return mac1rs.status();
-  quint32 mac0 = mac0rs.ValueOrDie(), mac1 = mac1rs.ValueOrDie();
   QDataStream s(&mac, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
   int oui = (mac1 >> 16) & 0xff;
@@ -231,19 +309,65 @@ util::Status ESPROMClient::softReset() {
 
 util::Status ESPROMClient::writeMem(quint32 addr, const QByteArray &data,
                                     quint32 jumpAddr) {
+  return writeMem(addr, QVector<QByteArray>{data}, jumpAddr);
+}
+
+util::Status ESPROMClient::writeMem(quint32 addr,
+                                    const QVector<QByteArray> &parts,
+                                    quint32 jumpAddr) {
+  int size = 0;
+  for (const QByteArray &part : parts) size += part.length();
   qDebug() << QString("ESPROMClient::writeMem(0x%1, %2, %3)")
                   .arg(addr, 0, 16)
-                  .arg(data.length())
+                  .arg(size)
                   .arg(jumpAddr, 0, 16);
-  quint32 numBlocks =
-      ((data.length() + memWriteBlockSize - 1) / memWriteBlockSize);
-  util::Status st =
-      memWriteStart(data.length(), numBlocks, memWriteBlockSize, addr);
+  quint32 numBlocks = ((size + memWriteBlockSize - 1) / memWriteBlockSize);
+  util::Status st = memWriteStart(size, numBlocks, memWriteBlockSize, addr);
   if (!st.ok()) return st;
-  for (int offset = 0; offset < data.length(); offset += memWriteBlockSize) {
-    int len = data.length() - offset;
-    if (len > memWriteBlockSize) len = memWriteBlockSize;
-    st = memWriteBlock(offset / memWriteBlockSize, data.mid(offset, len));
+  // Send the next block while the previous one is being acknowledged.
+  int numInFlight = 0;
+  int partIndex = 0, partOffset = 0;
+  QByteArray joined;
+  for (int offset = 0; offset < size; offset += memWriteBlockSize) {
+    const int len = std::min(size - offset, memWriteBlockSize);
+    while (partOffset == parts[partIndex].length()) {
+      partIndex++;
+      partOffset = 0;
+    }
+    const QByteArray &part = parts[partIndex];
+    QByteArray block;
+    if (part.length() - partOffset >= len) {
+      // Block is only used for the duration of the call, don't copy it.
+      block = QByteArray::fromRawData(part.constData() + partOffset, len);
+      partOffset += len;
+    } else {
+      // Block spans parts, only these get copied.
+      joined.resize(0);
+      while (joined.length() < len) {
+        if (partOffset == parts[partIndex].length()) {
+          partIndex++;
+          partOffset = 0;
+          continue;
+        }
+        const int n = std::min(len - joined.length(),
+                               parts[partIndex].length() - partOffset);
+        joined.append(parts[partIndex].constData() + partOffset, n);
+        partOffset += n;
+      }
+      block = joined;
+    }
+    const quint32 seq = offset / memWriteBlockSize;
+    st = sendCommand(Command::MemWriteBlock, {quint32(len), seq, 0, 0}, block,
+                     checksum(block));
+    if (!st.ok()) return st;
+    if (++numInFlight == kMemWriteBlocksInFlight) {
+      st = checkStatus(recvResponse(Command::MemWriteBlock), "memWriteBlock");
+      if (!st.ok()) return st;
+      numInFlight--;
+    }
+  }
+  for (; numInFlight > 0; numInFlight--) {
+    st = checkStatus(recvResponse(Command::MemWriteBlock), "memWriteBlock");
     if (!st.ok()) return st;
   }
   return memWriteFinish(jumpAddr);
@@ -252,9 +376,8 @@ util::Status ESPROMClient::writeMem(quint32 addr, const QByteArray &data,
 // static
 quint8 ESPROMClient::checksum(const QByteArray &data) {
   quint8 r = 0xEF;
-  for (int i = 0; i < data.length(); i++) {
-    r ^= data[i];
-  }
+  const char *p = data.constData(), *end = p + data.length();
+  while (p < end) r ^= *p++;
   return r;
 }
 
@@ -273,99 +396,120 @@ util::Status ESPROMClient::checkStatus(util::StatusOr<Response> sr,
 }
 
 util::StatusOr<ESPROMClient::Response> ESPROMClient::command(
-    Command cmd, const QByteArray &arg, quint8 csum, bool expectResponse,
-    int timeoutMs) {
-  Response resp;
-  QByteArray frame;
-  QDataStream s(&frame, QIODevice::WriteOnly);
-  s.setByteOrder(QDataStream::LittleEndian);
-  s << quint8(0) << quint8(cmd) << quint16(arg.length());
-  s << quint32(csum);  // Yes, it is indeed padded with 3 zero bytes.
-  frame.append(arg);
-  data_port_->readAll();  // Flush the buffer before command.
-  qDebug() << "Command:" << quint8(cmd) << "arg:" << arg.toHex();
-  SLIP::send(data_port_, frame);
-
-  if (expectResponse) {
-    auto frame =
-        SLIP::recv(data_port_, timeoutMs > 0 ? timeoutMs : commandTimeoutMs_);
-    if (!frame.ok()) return frame.status();
-    const QByteArray &respBytes = frame.ValueOrDie();
-    if (respBytes.length() < 10) {
-      return QS(util::error::INTERNAL,
-                QString("Incomplete response: ") + respBytes.toHex());
-    }
-    QDataStream s(respBytes);
-    s.setByteOrder(QDataStream::LittleEndian);
-    quint8 direction;
-    s >> direction;
-    if (direction != 1) {
-      return QS(
-          util::error::INTERNAL,
-          QString("Invalid direction (first byte) in response:") + direction);
-    }
+    Command cmd, std::initializer_list<quint32> words, const QByteArray &data,
+    quint8 csum, int timeoutMs) {
+  decoder_->flush();  // Flush the buffer before command.
+  util::Status st = sendCommand(cmd, words, data, csum);
+  if (!st.ok()) return st;
+  return recvResponse(cmd, timeoutMs);
+}
 
-    quint8 respCommand;
-    quint16 bodySize;
-    s >> respCommand >> bodySize >> resp.value;
+util::Status ESPROMClient::sendCommand(Command cmd,
+                                       std::initializer_list<quint32> words,
+                                       const QByteArray &data, quint8 csum) {
+  const int argLen = words.size() * 4 + data.length();
+  // Capacity is reserved, so this only allocates for oversized commands.
+  frame_.resize(kHeaderSize + argLen);
+  uchar *p = (uchar *) frame_.data();
+  p[0] = 0;
+  p[1] = quint8(cmd);
+  qToLittleEndian(quint16(argLen), p + 2);
+  qToLittleEndian(quint32(csum), p + 4);  // Yes, it is padded with 3 zeroes.
+  p += kHeaderSize;
+  for (const quint32 w : words) {
+    qToLittleEndian(w, p);
+    p += 4;
+  }
+  memcpy(p, data.constData(), data.length());
+  qDebug() << "Command:" << quint8(cmd) << "arg len:" << argLen;
+  return SLIP::send(data_port_, frame_, &encodedFrame_);
+}
 
-    if (respCommand != static_cast<quint8>(cmd)) {
-      return QS(util::error::INTERNAL,
-                QString("Response to a different command (") + respCommand +
-                    "vs" + static_cast<quint8>(cmd) + ")");
-    }
+util::StatusOr<ESPROMClient::Response> ESPROMClient::recvResponse(
+    Command cmd, int timeoutMs) {
+  Response resp;
+  auto frame = decoder_->recv(timeoutMs > 0 ? timeoutMs : commandTimeoutMs_);
+  if (!frame.ok()) return frame.status();
+  const QByteArray &respBytes = frame.ValueOrDie();
+  if (respBytes.length() < 10) {
+    return QS(util::error::INTERNAL,
+              QString("Incomplete response: ") + respBytes.toHex());
+  }
+  const uchar *rp = (const uchar *) respBytes.constData();
+  const quint8 direction = rp[0];
+  if (direction != 1) {
+    return QS(
+        util::error::INTERNAL,
+        QString("Invalid direction (first byte) in response:") + direction);
+  }
 
-    quint16 expectedSize = 1 + 1 + 2 + 4 + bodySize;
-    if (respBytes.length() != expectedSize) {
-      return QS(util::error::INTERNAL,
-                QString("Incorrect response size. Expected ") + expectedSize +
-                    ", got" + respBytes.size());
-    }
+  const quint8 respCommand = rp[1];
+  const quint16 bodySize = qFromLittleEndian<quint16>(rp + 2);
+  resp.value = qFromLittleEndian<quint32>(rp + 4);
 
-    resp.body.resize(bodySize);
-    s.readRawData(resp.body.data(), bodySize);
+  if (respCommand != static_cast<quint8>(cmd)) {
+    return QS(util::error::INTERNAL,
+              QString("Response to a different command (") + respCommand +
+                  "vs" + static_cast<quint8>(cmd) + ")");
+  }
 
-    if (bodySize == 2) {
-      char *body = resp.body.data();
-      resp.status = body[0];
-      resp.lastError = body[1];
-    }
+  quint16 expectedSize = kHeaderSize + bodySize;
+  if (respBytes.length() != expectedSize) {
+    return QS(util::error::INTERNAL,
+              QString("Incorrect response size. Expected ") + expectedSize +
+                  ", got" + respBytes.size());
+  }
+
+  if (bodySize == 2) {
+    resp.status = rp[kHeaderSize];
+    resp.lastError = rp[kHeaderSize + 1];
   }
   return resp;
 }
 
-util::Status ESPROMClient::runStub(const QByteArray &stubJSON,
+util::Status ESPROMClient::runStub(const QByteArray &stubImage,
                                    QVector<quint32> params) {
-  QJsonDocument stubDoc(QJsonDocument::fromJson(stubJSON));
-  const QJsonObject &stub = stubDoc.object();
-  qDebug() << "Running stub:" << stub;
+  // See common/platforms/esp8266/stubs/README.md for the image format.
+  const uchar *h = (const uchar *) stubImage.constData();
+  if (stubImage.length() < kStubHeaderSize || memcmp(h, "STUB", 4) != 0) {
+    return QS(util::error::INVALID_ARGUMENT, "Invalid stub image");
+  }
+  const quint32 numParams = qFromLittleEndian<quint32>(h + 4);
+  const quint32 paramsStart = qFromLittleEndian<quint32>(h + 8);
+  const quint32 codeStart = qFromLittleEndian<quint32>(h + 12);
+  const quint32 codeLen = qFromLittleEndian<quint32>(h + 16);
+  const quint32 dataStart = qFromLittleEndian<quint32>(h + 20);
+  const quint32 dataLen = qFromLittleEndian<quint32>(h + 24);
+  const quint32 entry = qFromLittleEndian<quint32>(h + 28);
+  if (quint64(kStubHeaderSize) + codeLen + dataLen >
+      quint64(stubImage.length())) {
+    return QS(util::error::INVALID_ARGUMENT, "Truncated stub image");
+  }
+  qDebug() << "Running stub: code" << codeLen << "@" << hex << codeStart
+           << "data" << dec << dataLen << "@" << hex << dataStart << "entry"
+           << entry;
   qDebug() << "Params:" << params;
-  int numParams = stub["num_params"].toDouble();
-  if (numParams != params.length()) {
+  if (numParams != quint32(params.length())) {
     return QS(util::error::INTERNAL, QObject::tr("Expected %1 params, got %2")
                                          .arg(numParams)
                                          .arg(params.length()));
   }
-  {  // Write data.
-    const QByteArray data =
-        QByteArray::fromHex(stub["data"].toString().toLatin1());
-    if (data.length() > 0) {
-      util::Status st = writeMem(stub["data_start"].toDouble(), data);
-      if (!st.ok()) return st;
-    }
-  }
-  {  // Write params + code and run.
-    const QByteArray code =
-        QByteArray::fromHex(stub["code"].toString().toLatin1());
-    const quint32 paramsStart = stub["params_start"].toDouble();
-    const quint32 entry = stub["entry"].toDouble();
-    QByteArray pc;
-    QDataStream pcs(&pc, QIODevice::WriteOnly);
-    pcs.setByteOrder(QDataStream::LittleEndian);
-    for (const quint32 p : params) pcs << p;
-    pc.append(code);
-    util::Status st = writeMem(paramsStart, pc, entry);
+  const char *code = stubImage.constData() + kStubHeaderSize;
+  if (dataLen > 0) {
+    util::Status st =
+        writeMem(dataStart, QByteArray::fromRawData(code + codeLen, dataLen));
     if (!st.ok()) return st;
   }
-  return util::Status::OK;
+  // Code immediately follows params, write them together and run. Saves a
+  // few round trips at the slow ROM baud rate. Code is sent from the image
+  // in place, only the block it shares with params gets copied.
+  if (codeStart != paramsStart + numParams * 4) {
+    return QS(util::error::INVALID_ARGUMENT, "Stub code must follow params");
+  }
+  QByteArray paramBytes(numParams * 4, 0);
+  for (quint32 i = 0; i < numParams; i++) {
+    qToLittleEndian(params[i], (uchar *) paramBytes.data() + i * 4);
+  }
+  return writeMem(paramsStart,
+                  {paramBytes, QByteArray::fromRawData(code, codeLen)}, entry);
 }
@@ -6,21 +6,27 @@
 #ifndef CS_MFT_SRC_ESP_ROM_CLIENT_H_
 #define CS_MFT_SRC_ESP_ROM_CLIENT_H_
 
+#include <initializer_list>
+
 #include <QByteArray>
-#include <QSerialPort>
 #include <QString>
 #include <QVector>
 
 #include <common/util/statusor.h>
 
+#include "slip.h"
+#include "transport.h"
+
 class ESPROMClient {
  public:
-  ESPROMClient(QSerialPort *control_port, QSerialPort *data_port);
+  ESPROMClient(Transport *control_port, Transport *data_port);
   ~ESPROMClient();
 
   // Accessors
-  QSerialPort *control_port();
-  QSerialPort *data_port();
+  Transport *control_port();
+  Transport *data_port();
+  // Frames received from the data port.
+  SLIP::Decoder *data_decoder();
   bool connected() const;
 
   // Establishes communication with the boot loader.
@@ -30,6 +36,8 @@ class ESPROMClient {
   util::Status sync();
   util::Status rebootIntoFirmware();
   util::StatusOr<quint32> readRegister(quint32 addr);
+  // Reads a number of registers, without waiting for each one in turn.
+  util::StatusOr<QVector<quint32>> readRegisters(const QVector<quint32> &addrs);
   util::Status memWriteStart(quint32 size, quint32 numBlocks, quint32 blockSize,
                              quint32 addr);
   util::Status memWriteBlock(quint32 seq, const QByteArray &data);
@@ -40,15 +48,25 @@ class ESPROMClient {
   util::Status flashWriteFinish(bool reboot);
 
   // Utility functions based on low-level functionality.
-  util::Status runStub(const QByteArray &stubJSON, QVector<quint32> params);
+  // Uploads a binary stub image and runs it.
+  util::Status runStub(const QByteArray &stubImage, QVector<quint32> params);
 
   // Read Wifi interface MAC address.
   util::StatusOr<QByteArray> readMAC();
+  // Efuse registers readMAC reads, and how it turns them into the address.
+  static const quint32 kMAC0Register;
+  static const quint32 kMAC1Register;
+  static util::StatusOr<QByteArray> macFromRegisters(quint32 mac0,
+                                                     quint32 mac1);
   // Perform a soft reset
   util::Status softReset();
   // Write a region of memory. Jumps to jumpAddr if non-zero.
   util::Status writeMem(quint32 addr, const QByteArray &data,
                         quint32 jumpAddr = 0);
+  // Same, for data made of consecutive parts, e.g. a small header in front
+  // of a big image, which then doesn't need to be copied to join them.
+  util::Status writeMem(quint32 addr, const QVector<QByteArray> &parts,
+                        quint32 jumpAddr = 0);
 
  private:
   enum class Command {
@@ -64,22 +82,36 @@ class ESPROMClient {
 
   struct Response {
     quint32 value = 0;
-    QByteArray body;
 
+    // Only set if the response body is 2 bytes long.
     quint8 status = 0;
     quint8 lastError = 0;
   };
 
   static quint8 checksum(const QByteArray &data);
+  // Resets the device with GPIO0 pulled down and waits for the boot banner,
+  // for at most maxBannerMs. Returns the time it took, -1 if there was none.
+  int resetIntoBootLoader(int maxBannerMs);
   static util::Status checkStatus(util::StatusOr<Response> sr,
                                   const QString &label);
 
-  util::StatusOr<Response> command(Command cmd, const QByteArray &arg,
-                                   quint8 csum = 0, bool expectResponse = true,
-                                   int timeoutMs = 0);
-
-  QSerialPort *control_port_;  // Not owned
-  QSerialPort *data_port_;     // Not owned
+  // Argument of the command is words followed by data. Frame is assembled in
+  // buffers that are reused between commands.
+  util::StatusOr<Response> command(Command cmd,
+                                   std::initializer_list<quint32> words,
+                                   const QByteArray &data = QByteArray(),
+                                   quint8 csum = 0, int timeoutMs = 0);
+  // Halves of command(), for pipelining. Caller is responsible for
+  // flushing stale input before sending.
+  util::Status sendCommand(Command cmd, std::initializer_list<quint32> words,
+                           const QByteArray &data, quint8 csum);
+  util::StatusOr<Response> recvResponse(Command cmd, int timeoutMs = 0);
+
+  Transport *control_port_;  // Not owned
+  Transport *data_port_;     // Not owned
+  SLIP::Decoder *decoder_;     // Owned by data_port_
+  QByteArray frame_;
+  QByteArray encodedFrame_;
   bool connected_ = false;
   bool inverted_ = false;
   int commandTimeoutMs_ = 2000;
@@ -10,6 +10,46 @@ const char Flasher::kMergeFSOption[] = "merge-flash-fs";
 const char Flasher::kFlashBaudRateOption[] = "flash-baud-rate";
 const char Flasher::kDumpFSOption[] = "dump-fs";
 
+Flasher::Phase::Phase(Flasher *flasher, const QString &name)
+    : flasher_(flasher), name_(name) {
+  timer_.start();
+  flasher_->emitEvent({{"event", "phase_start"}, {"phase", name_}});
+}
+
+Flasher::Phase::~Phase() {
+  if (!ended_) end(false);
+}
+
+void Flasher::Phase::addBytes(qint64 bytes) {
+  bytes_ += bytes;
+}
+
+void Flasher::Phase::retry() {
+  retries_++;
+}
+
+void Flasher::Phase::end(bool ok) {
+  if (ended_) return;
+  ended_ = true;
+  const qint64 elapsedMs = timer_.elapsed();
+  QJsonObject e({{"event", "phase_end"},
+                 {"phase", name_},
+                 {"ok", ok},
+                 {"elapsed_ms", double(elapsedMs)},
+                 {"retries", retries_}});
+  if (bytes_ > 0) {
+    e["bytes"] = double(bytes_);
+    e["bytes_per_sec"] =
+        elapsedMs > 0 ? double(bytes_ * 1000 / elapsedMs) : double(bytes_);
+  }
+  flasher_->emitEvent(e);
+}
+
+void Flasher::emitEvent(QJsonObject event) {
+  event["ts"] = double(QDateTime::currentMSecsSinceEpoch());
+  emit progressEvent(event);
+}
+
 QByteArray randomDeviceID(const QString &domain) {
   qsrand(QDateTime::currentMSecsSinceEpoch() & 0xFFFFFFFF);
   QByteArray random;
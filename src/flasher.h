@@ -6,6 +6,8 @@
 #ifndef CS_MFT_SRC_FLASHER_H_
 #define CS_MFT_SRC_FLASHER_H_
 
+#include <QElapsedTimer>
+#include <QJsonObject>
 #include <QObject>
 #include <QSerialPort>
 #include <QString>
@@ -53,6 +55,36 @@ signals:
   void progress(int blocksWritten);
   void statusMessage(QString message, bool important = false);
   void done(QString message, bool success);
+  // Machine-readable counterpart of the above, for logs and dashboards.
+  // "event" is phase_start or phase_end, "phase" is its name (connect, stub,
+  // detect, merge, dedup, erase, write, verify, boot and such) and "ts" is
+  // the time in ms since epoch. phase_end also has "ok", "elapsed_ms",
+  // "retries" and, if the phase transferred data, "bytes" and
+  // "bytes_per_sec".
+  void progressEvent(const QJsonObject &event);
+
+ protected:
+  // Emits phase_start when created and phase_end when end() is called.
+  // Phase that goes out of scope without end() is reported as failed.
+  class Phase {
+   public:
+    Phase(Flasher *flasher, const QString &name);
+    ~Phase();
+
+    void addBytes(qint64 bytes);
+    void retry();
+    void end(bool ok);
+
+   private:
+    Flasher *flasher_;
+    const QString name_;
+    QElapsedTimer timer_;
+    qint64 bytes_ = 0;
+    int retries_ = 0;
+    bool ended_ = false;
+  };
+
+  void emitEvent(QJsonObject event);
 };
 
 QByteArray randomDeviceID(const QString &domain);
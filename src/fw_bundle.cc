@@ -45,10 +45,6 @@ QMap<QString, FirmwareBundle::Part> FirmwareBundle::parts() const {
   return parts_;
 }
 
-QMap<QString, QByteArray> FirmwareBundle::blobs() const {
-  return blobs_;
-}
-
 util::StatusOr<QByteArray> FirmwareBundle::getPartSource(
     const QString &partName) const {
   if (!parts_.contains(partName)) {
@@ -61,21 +57,21 @@ util::StatusOr<QByteArray> FirmwareBundle::getPartSource(
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("part %1: no source specified").arg(p.name));
   }
-  if (!blobs_.contains(src)) {
-    return QS(
-        util::error::INVALID_ARGUMENT,
-        QObject::tr("part %1: source %2 does not exist").arg(p.name).arg(src));
+  QByteArray sha1;
+  auto dr = readBlob(src, &sha1);
+  if (!dr.ok()) {
+    return QSP(QObject::tr("part %1").arg(p.name), dr.status());
   }
-  const QByteArray &data = blobs_[src];
+  const QByteArray &data = dr.ValueOrDie();
   const QString &expected_digest = p.attrs["cs_sha1"].toString().toLower();
   if (expected_digest == "") {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("part %1: missing SHA1 digest").arg(p.name));
   }
-  const QString &digest =
-      QCryptographicHash::hash(data, QCryptographicHash::Sha1)
-          .toHex()
-          .toLower();
+  if (sha1.isEmpty()) {
+    sha1 = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+  }
+  const QString &digest = sha1.toHex().toLower();
   if (digest != expected_digest) {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("part %1: invalid digest - expected %2, got %3")
@@ -85,3 +81,29 @@ util::StatusOr<QByteArray> FirmwareBundle::getPartSource(
   }
   return data;
 }
+
+util::StatusOr<QByteArray> FirmwareBundle::getPartDeflatedSource(
+    const QString &partName) const {
+  if (!parts_.contains(partName)) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("No %1 in fw bundle").arg(partName));
+  }
+  const QString src = parts_[partName].attrs["src"].toString();
+  if (!deflatedBlobs_.contains(src)) {
+    return QS(util::error::NOT_FOUND,
+              QObject::tr("part %1: source %2 is not compressed")
+                  .arg(partName)
+                  .arg(src));
+  }
+  return deflatedBlobs_[src];
+}
+
+util::StatusOr<QByteArray> FirmwareBundle::readBlob(const QString &name,
+                                                    QByteArray *sha1) const {
+  sha1->clear();
+  if (!blobs_.contains(name)) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("source %1 does not exist").arg(name));
+  }
+  return blobs_[name];
+}
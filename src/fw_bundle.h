@@ -35,12 +35,25 @@ class FirmwareBundle {
   };
 
   QMap<QString, Part> parts() const;
-  QMap<QString, QByteArray> blobs() const;
 
   util::StatusOr<QByteArray> getPartSource(const QString &partName) const;
 
+  // Returns raw deflate stream of the part's source, if the bundle has one.
+  // It can be sent to the device as is, without re-compressing the data.
+  util::StatusOr<QByteArray> getPartDeflatedSource(
+      const QString &partName) const;
+
  protected:
+  // Returns contents of a blob. If the SHA1 digest of the data is computed
+  // along the way, it is stored in *sha1, otherwise *sha1 is left empty.
+  virtual util::StatusOr<QByteArray> readBlob(const QString &name,
+                                              QByteArray *sha1) const;
+
+  // Blobs that were stored uncompressed.
   QMap<QString, QByteArray> blobs_;
+  // Raw deflate streams of blobs that were compressed in the bundle. These
+  // are only inflated when read, so that the bundle does not hold both.
+  QMap<QString, QByteArray> deflatedBlobs_;
   QMap<QString, Part> parts_;
 
  private:
@@ -2,6 +2,7 @@
 
 #include <cstring>
 
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -35,12 +36,26 @@ class ZipFWBundle : public FirmwareBundle {
 
   util::Status loadFile(const QString &zipFileName);
 
+ protected:
+  util::StatusOr<QByteArray> readBlob(const QString &name,
+                                      QByteArray *sha1) const override;
+
  private:
+  // Size and CRC32 of the inflated data.
+  struct DeflatedBlobInfo {
+    quint64 size;
+    mz_ulong crc32;
+  };
+
   util::Status loadContents();
+  util::StatusOr<QByteArray> inflateBlob(const QByteArray &deflated,
+                                         const DeflatedBlobInfo &info,
+                                         QByteArray *sha1) const;
   util::Status readManifest();
 
   mz_zip_archive zip_;
   QJsonObject manifest_;
+  QMap<QString, DeflatedBlobInfo> deflatedBlobInfo_;
 };
 
 util::Status ZipFWBundle::loadFile(const QString &zipFileName) {
@@ -68,6 +83,29 @@ util::Status ZipFWBundle::loadContents() {
     QString name(stat.m_filename);
     QString base_name = name.split("/").back();
     size_t uncomp_size;
+    if (stat.m_method == MZ_DEFLATED) {
+      // Keep the compressed stream, it can be sent to the device as is.
+      char *data = (char *) mz_zip_reader_extract_to_heap(
+          &zip_, i, &uncomp_size, MZ_ZIP_FLAG_COMPRESSED_DATA);
+      if (data == NULL) {
+        return QS(util::error::INVALID_ARGUMENT,
+                  QObject::tr("failed to extract %1").arg(name));
+      }
+      QByteArray deflated(data, uncomp_size);
+      mz_free(data);
+      const DeflatedBlobInfo info = {stat.m_uncomp_size, stat.m_crc32};
+      // Check the stream now, the result is not kept.
+      QByteArray sha1;
+      auto dr = inflateBlob(deflated, info, &sha1);
+      if (!dr.ok()) {
+        return QSP(QObject::tr("failed to inflate %1").arg(name), dr.status());
+      }
+      qDebug() << "Blob" << base_name << info.size << "deflated"
+               << deflated.length();
+      deflatedBlobs_[base_name] = deflated;
+      deflatedBlobInfo_[base_name] = info;
+      continue;
+    }
     char *data =
         (char *) mz_zip_reader_extract_to_heap(&zip_, i, &uncomp_size, 0);
     if (data == NULL) {
@@ -82,13 +120,68 @@ util::Status ZipFWBundle::loadContents() {
   return util::Status::OK;
 }
 
+util::StatusOr<QByteArray> ZipFWBundle::readBlob(const QString &name,
+                                                 QByteArray *sha1) const {
+  if (!deflatedBlobs_.contains(name)) {
+    return FirmwareBundle::readBlob(name, sha1);
+  }
+  return inflateBlob(deflatedBlobs_[name], deflatedBlobInfo_[name], sha1);
+}
+
+// Inflates the blob and computes its SHA1 on the fly, so the data does not
+// need to be hashed again when the part is fetched.
+util::StatusOr<QByteArray> ZipFWBundle::inflateBlob(
+    const QByteArray &deflated, const DeflatedBlobInfo &info,
+    QByteArray *sha1) const {
+  std::unique_ptr<tinfl_decompressor> inflater(new tinfl_decompressor);
+  QByteArray dict(TINFL_LZ_DICT_SIZE, 0);
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  mz_ulong crc32 = MZ_CRC32_INIT;
+  QByteArray data;
+  data.reserve(info.size);
+  tinfl_init(inflater.get());
+  const mz_uint8 *in = (const mz_uint8 *) deflated.constData();
+  size_t inLeft = deflated.length(), dictOfs = 0;
+  mz_uint8 *out = (mz_uint8 *) dict.data();
+  tinfl_status status;
+  do {
+    size_t inBytes = inLeft, outBytes = TINFL_LZ_DICT_SIZE - dictOfs;
+    status = tinfl_decompress(inflater.get(), in, &inBytes, out, out + dictOfs,
+                              &outBytes, 0);
+    if (status < TINFL_STATUS_DONE) {
+      return QS(util::error::INVALID_ARGUMENT,
+                QObject::tr("inflate error %1").arg(status));
+    }
+    const char *chunk = (const char *) out + dictOfs;
+    hash.addData(chunk, outBytes);
+    crc32 = mz_crc32(crc32, out + dictOfs, outBytes);
+    data.append(chunk, outBytes);
+    in += inBytes;
+    inLeft -= inBytes;
+    dictOfs = (dictOfs + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+  } while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+  if (status != TINFL_STATUS_DONE) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("truncated deflate stream"));
+  }
+  if (quint64(data.length()) != info.size || crc32 != info.crc32) {
+    return QS(util::error::INVALID_ARGUMENT, QObject::tr("CRC mismatch"));
+  }
+  *sha1 = hash.result();
+  return data;
+}
+
 util::Status ZipFWBundle::readManifest() {
-  if (!blobs_.contains(kManifestFileName)) {
+  if (!blobs_.contains(kManifestFileName) &&
+      !deflatedBlobs_.contains(kManifestFileName)) {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("No %1 in archive").arg(kManifestFileName));
   }
+  QByteArray sha1;
+  auto mr = readBlob(kManifestFileName, &sha1);
+  if (!mr.ok()) return mr.status();
   QJsonParseError err;
-  QJsonDocument doc = QJsonDocument::fromJson(blobs_[kManifestFileName], &err);
+  QJsonDocument doc = QJsonDocument::fromJson(mr.ValueOrDie(), &err);
   if (err.error != QJsonParseError::NoError) {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("Failed to parse JSON: %1").arg(err.errorString()));
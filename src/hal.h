@@ -13,6 +13,7 @@
 #include "flasher.h"
 #include "prompter.h"
 
+class Config;
 class QSerialPort;
 class QSerialPortInfo;
 
@@ -24,6 +25,9 @@ class HAL {
   virtual std::unique_ptr<Flasher> flasher(Prompter *prompter) const = 0;
   virtual std::string name() const = 0;
   virtual util::Status reboot() = 0;
+  // Reads the entire flash and writes it to a file.
+  virtual util::Status dumpFlash(const Config &config,
+                                 const QString &fileName) const = 0;
 };
 
 #endif /* CS_MFT_SRC_HAL_H_ */
@@ -0,0 +1,99 @@
+#include "io_reactor.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <QDebug>
+#include <QMutexLocker>
+
+#ifdef Q_OS_LINUX
+#include <sys/epoll.h>
+#endif
+
+#include <common/util/error_codes.h>
+
+#include "status_qt.h"
+
+// static
+IOReactor *IOReactor::instance() {
+  // Never destroyed, the thread runs until the process exits.
+  static IOReactor *reactor = nullptr;
+  static QMutex lock;
+  QMutexLocker l(&lock);
+  if (reactor == nullptr) {
+    reactor = new IOReactor();
+    reactor->start();
+  }
+  return reactor;
+}
+
+IOReactor::IOReactor() {
+#ifdef Q_OS_LINUX
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    qCritical() << "epoll_create1 failed:" << strerror(errno);
+  }
+#endif
+}
+
+util::Status IOReactor::add(int fd, Handler *handler) {
+#ifdef Q_OS_LINUX
+  QMutexLocker l(&lock_);
+  if (epoll_fd_ < 0) {
+    return QS(util::error::UNAVAILABLE, "reactor is not running");
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    return QS(util::error::UNAVAILABLE,
+              QString("epoll_ctl(%1) failed: %2").arg(fd).arg(strerror(errno)));
+  }
+  handlers_[fd] = handler;
+  return util::Status::OK;
+#else
+  Q_UNUSED(fd);
+  Q_UNUSED(handler);
+  return QS(util::error::UNIMPLEMENTED, "not supported on this platform");
+#endif
+}
+
+void IOReactor::remove(int fd) {
+  QMutexLocker l(&lock_);
+  if (handlers_.remove(fd) == 0) return;
+#ifdef Q_OS_LINUX
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+void IOReactor::runExclusive(const std::function<void()> &fn) {
+  QMutexLocker l(&lock_);
+  fn();
+}
+
+void IOReactor::run() {
+#ifdef Q_OS_LINUX
+  if (epoll_fd_ < 0) return;
+  struct epoll_event events[16];
+  while (true) {
+    const int n = epoll_wait(epoll_fd_, events, 16, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      qCritical() << "epoll_wait failed:" << strerror(errno);
+      return;
+    }
+    QMutexLocker l(&lock_);
+    for (int i = 0; i < n; i++) {
+      const int fd = events[i].data.fd;
+      // Handler may have been removed since epoll_wait returned.
+      Handler *h = handlers_.value(fd);
+      if (h == nullptr) continue;
+      if (!h->readable(fd)) {
+        handlers_.remove(fd);
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+      }
+    }
+  }
+#endif
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_IO_REACTOR_H_
+#define CS_MFT_SRC_IO_REACTOR_H_
+
+#include <functional>
+
+#include <QMap>
+#include <QMutex>
+#include <QThread>
+
+#include <common/util/status.h>
+
+// Waits for input on any number of file descriptors on a single dedicated
+// thread (epoll) and calls their handlers there. Linux only.
+class IOReactor : public QThread {
+ public:
+  class Handler {
+   public:
+    virtual ~Handler() {
+    }
+    // Called on the reactor thread when fd is readable. Returning false
+    // unregisters the handler.
+    virtual bool readable(int fd) = 0;
+  };
+
+  // Returns the process-wide reactor, starting it if necessary.
+  static IOReactor *instance();
+
+  util::Status add(int fd, Handler *handler);
+  // Once this returns, handler is not running and will not be called again.
+  void remove(int fd);
+  // Calls fn on the calling thread while no handler is running, so that it
+  // can touch handlers' state.
+  void runExclusive(const std::function<void()> &fn);
+
+ protected:
+  void run() override;
+
+ private:
+  IOReactor();
+
+  int epoll_fd_ = -1;
+  QMutex lock_;  // Held while handlers run.
+  QMap<int, Handler *> handlers_;
+};
+
+#endif /* CS_MFT_SRC_IO_REACTOR_H_ */
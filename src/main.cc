@@ -16,7 +16,8 @@ int main(int argc, char *argv[]) {
   if (!initApp(&argc, argv, &config, &parser).ok()) return 1;
 
   if (!parser.isSet("flash") && !parser.isSet("console") &&
-      !parser.isSet("probe") && !parser.isSet("get-mac")) {
+      !parser.isSet("probe") && !parser.isSet("get-mac") &&
+      !parser.isSet("daemon")) {
     // Run in GUI mode.
     QApplication app(argc, argv);
     parser.process(app);
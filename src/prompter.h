@@ -23,6 +23,16 @@ class Prompter : public QObject {
   virtual int Prompt(QString text,
                      QList<QPair<QString, ButtonRole>> buttons) = 0;
 
+  // Answer for prompters that have nobody to ask: the Reject button, since
+  // going ahead or retrying unattended can loop forever or lose data.
+  // First button if there is no Reject one.
+  static int defaultAnswer(const QList<QPair<QString, ButtonRole>> &buttons) {
+    for (int i = 0; i < buttons.size(); i++) {
+      if (buttons[i].second == ButtonRole::Reject) return i;
+    }
+    return 0;
+  }
+
   virtual ~Prompter() {
   }
 };
@@ -0,0 +1,230 @@
+#include "rfc2217.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <QDataStream>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QTcpSocket>
+
+#include <common/util/error_codes.h>
+
+#include "status_qt.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+// Com port commands (RFC 2217).
+const quint8 kSetBaudRate = 1;
+const quint8 kSetDataSize = 2;
+const quint8 kSetParity = 3;
+const quint8 kSetStopSize = 4;
+const quint8 kSetControl = 5;
+const quint8 kPurgeData = 12;
+
+// Values of kSetControl.
+const quint8 kControlNoFlowControl = 1;
+const quint8 kControlBreakOn = 5;
+const quint8 kControlBreakOff = 6;
+const quint8 kControlDTROn = 8;
+const quint8 kControlDTROff = 9;
+const quint8 kControlRTSOn = 11;
+const quint8 kControlRTSOff = 12;
+
+const quint8 kParityNone = 1;
+const quint8 kStopSize1 = 1;
+const quint8 kPurgeBoth = 3;
+
+const int kConnectTimeoutMs = 5000;
+const int kReplyTimeoutMs = 2000;
+
+QByteArray toQByteArray(const std::string &s) {
+  return QByteArray(s.data(), s.length());
+}
+
+}  // namespace
+
+RFC2217Transport::RFC2217Transport(const QString &location)
+    : Transport(nullptr), location_(location), socket_(new QTcpSocket(this)) {
+  connect(socket_, &QTcpSocket::readyRead, this,
+          &RFC2217Transport::socketReadyRead);
+}
+
+// static
+util::StatusOr<Transport *> RFC2217Transport::open(const QString &location,
+                                                   int speed) {
+  std::string host;
+  int port = 0;
+  util::Status st =
+      RFC2217Codec::parseLocation(location.toStdString(), &host, &port);
+  if (!st.ok()) return st;
+  std::unique_ptr<RFC2217Transport> t(new RFC2217Transport(location));
+  t->socket_->connectToHost(QString::fromStdString(host), port);
+  if (!t->socket_->waitForConnected(kConnectTimeoutMs)) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("Failed to connect to %1: %2")
+                  .arg(location)
+                  .arg(t->socket_->errorString()));
+  }
+  t->socket_->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+  t->socket_->write(toQByteArray(RFC2217Codec::negotiation()));
+  const QString prefix = QString("RFC2217Transport::open(%1): ").arg(location);
+  const std::pair<quint8, quint8> settings[] = {
+      {kSetDataSize, 8},
+      {kSetParity, kParityNone},
+      {kSetStopSize, kStopSize1},
+      {kSetControl, kControlNoFlowControl},
+  };
+  for (const auto &s : settings) {
+    auto res = t->comPortCommand(s.first, QByteArray(1, s.second));
+    if (!res.ok()) {
+      return QSP(prefix + "failed to configure port", res.status());
+    }
+  }
+  st = t->setBaudRate(speed);
+  if (!st.ok()) return st;
+  return t.release();
+}
+
+QString RFC2217Transport::portName() const {
+  return location_;
+}
+
+QString RFC2217Transport::errorString() const {
+  return socket_->errorString();
+}
+
+qint64 RFC2217Transport::bytesAvailable() const {
+  return rx_.length();
+}
+
+QByteArray RFC2217Transport::read(qint64 maxSize) {
+  const QByteArray r = rx_.left(maxSize);
+  rx_.remove(0, r.length());
+  return r;
+}
+
+QByteArray RFC2217Transport::readAll() {
+  QByteArray r;
+  r.swap(rx_);
+  return r;
+}
+
+qint64 RFC2217Transport::write(const char *data, qint64 size) {
+  const QByteArray escaped = toQByteArray(RFC2217Codec::escape(data, size));
+  if (socket_->write(escaped) != escaped.length()) return -1;
+  return size;
+}
+
+bool RFC2217Transport::waitForReadyRead(int msecs) {
+  QElapsedTimer timer;
+  timer.start();
+  while (rx_.isEmpty()) {
+    // Data may consist entirely of Telnet commands, keep waiting.
+    const int remaining = msecs < 0 ? -1 : msecs - timer.elapsed();
+    if (msecs >= 0 && remaining <= 0) return false;
+    if (!socket_->waitForReadyRead(remaining)) return false;
+    socketReadyRead();
+  }
+  return true;
+}
+
+bool RFC2217Transport::waitForBytesWritten(int msecs) {
+  return socket_->bytesToWrite() == 0 || socket_->waitForBytesWritten(msecs);
+}
+
+bool RFC2217Transport::clear() {
+  auto res = comPortCommand(kPurgeData, QByteArray(1, kPurgeBoth));
+  rx_.clear();
+  return res.ok();
+}
+
+qint32 RFC2217Transport::baudRate() const {
+  return baudRate_;
+}
+
+util::Status RFC2217Transport::setBaudRate(qint32 baudRate) {
+  const QString prefix = QString("RFC2217Transport::setBaudRate(%1, %2): ")
+                             .arg(location_)
+                             .arg(baudRate);
+  qInfo() << "Setting" << location_ << "speed to" << baudRate;
+  QByteArray value;
+  QDataStream s(&value, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::BigEndian);
+  s << quint32(baudRate);
+  auto res = comPortCommand(kSetBaudRate, value);
+  if (!res.ok()) return QSP(prefix + "command failed", res.status());
+  baudRate_ = baudRate;
+  return util::Status::OK;
+}
+
+bool RFC2217Transport::setDataTerminalReady(bool set) {
+  return comPortCommand(kSetControl,
+                        QByteArray(1, set ? kControlDTROn : kControlDTROff))
+      .ok();
+}
+
+bool RFC2217Transport::setRequestToSend(bool set) {
+  return comPortCommand(kSetControl,
+                        QByteArray(1, set ? kControlRTSOn : kControlRTSOff))
+      .ok();
+}
+
+bool RFC2217Transport::setBreakEnabled(bool set) {
+  return comPortCommand(kSetControl,
+                        QByteArray(1, set ? kControlBreakOn : kControlBreakOff))
+      .ok();
+}
+
+void RFC2217Transport::socketReadyRead() {
+  const QByteArray data = socket_->readAll();
+  if (data.isEmpty()) return;
+  const bool wasRefused = codec_.comPortRefused();
+  std::string rx, response;
+  codec_.processInput(data.constData(), data.length(), &rx, &response);
+  if (!response.empty()) socket_->write(toQByteArray(response));
+  if (!wasRefused && codec_.comPortRefused()) {
+    qWarning() << location_ << "does not support com port control";
+  }
+  if (rx.empty()) return;
+  rx_.append(rx.data(), rx.length());
+  emit readyRead();
+}
+
+util::StatusOr<QByteArray> RFC2217Transport::comPortCommand(
+    quint8 cmd, const QByteArray &value) {
+  const QString prefix =
+      QString("RFC2217Transport::comPortCommand(%1, %2): ").arg(cmd).arg(
+          QString(value.toHex()));
+  if (codec_.comPortRefused()) {
+    return QS(util::error::UNIMPLEMENTED,
+              prefix + "com port control refused by the server");
+  }
+  const QByteArray req = toQByteArray(RFC2217Codec::comPortRequest(
+      cmd, std::string(value.constData(), value.length())));
+  codec_.clearReply(cmd);
+  if (socket_->write(req) != req.length() || !socket_->flush()) {
+    return QS(util::error::UNAVAILABLE,
+              prefix + "write failed: " + socket_->errorString());
+  }
+  QElapsedTimer timer;
+  timer.start();
+  std::string reply;
+  while (!codec_.takeReply(cmd, &reply)) {
+    const int remaining = kReplyTimeoutMs - timer.elapsed();
+    if (codec_.comPortRefused()) {
+      return QS(util::error::UNIMPLEMENTED,
+                prefix + "com port control refused by the server");
+    }
+    if (remaining <= 0 || !socket_->waitForReadyRead(remaining)) {
+      return QS(util::error::DEADLINE_EXCEEDED, prefix + "no reply");
+    }
+    socketReadyRead();
+  }
+  return toQByteArray(reply);
+}
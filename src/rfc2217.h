@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_RFC2217_H_
+#define CS_MFT_SRC_RFC2217_H_
+
+#include <QByteArray>
+#include <QString>
+
+#include <common/util/statusor.h>
+
+#include "rfc2217_codec.h"
+#include "transport.h"
+
+class QTcpSocket;
+
+// Transport for a serial port exported by a remote host over Telnet with the
+// Com Port Control Option (RFC 2217), e.g. by ser2net. Baud rate, DTR, RTS
+// and break are forwarded to the remote port.
+class RFC2217Transport : public Transport {
+  Q_OBJECT
+
+ public:
+  // Connects to rfc2217://host:port and configures the port for 8N1 at the
+  // given speed. Caller owns the returned transport.
+  static util::StatusOr<Transport *> open(const QString &location,
+                                          int speed);
+
+  QString portName() const override;
+  QString errorString() const override;
+
+  qint64 bytesAvailable() const override;
+  QByteArray read(qint64 maxSize) override;
+  QByteArray readAll() override;
+  using Transport::write;
+  qint64 write(const char *data, qint64 size) override;
+  bool waitForReadyRead(int msecs) override;
+  bool waitForBytesWritten(int msecs) override;
+  bool clear() override;
+
+  qint32 baudRate() const override;
+  util::Status setBaudRate(qint32 baudRate) override;
+  bool setDataTerminalReady(bool set) override;
+  bool setRequestToSend(bool set) override;
+  bool setBreakEnabled(bool set) override;
+
+ private:
+  explicit RFC2217Transport(const QString &location);
+
+  void socketReadyRead();
+
+  // Sends a com port command and waits for the server to acknowledge it.
+  util::StatusOr<QByteArray> comPortCommand(quint8 cmd,
+                                            const QByteArray &value);
+
+  const QString location_;
+  QTcpSocket *socket_;  // Owned by this
+  RFC2217Codec codec_;
+  QByteArray rx_;  // Received data with Telnet commands stripped.
+  qint32 baudRate_ = 0;
+};
+
+#endif /* CS_MFT_SRC_RFC2217_H_ */
@@ -0,0 +1,197 @@
+#include "rfc2217_codec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/util/error_codes.h>
+
+namespace {
+
+// Telnet commands (RFC 854).
+const uint8_t kIAC = 255;
+const uint8_t kDONT = 254;
+const uint8_t kDO = 253;
+const uint8_t kWONT = 252;
+const uint8_t kWILL = 251;
+const uint8_t kSB = 250;
+const uint8_t kSE = 240;
+
+// Telnet options.
+const uint8_t kOptionBinary = 0;
+const uint8_t kOptionSuppressGoAhead = 3;
+const uint8_t kOptionComPort = 44;
+
+// Server replies to com port commands with command + 100.
+const uint8_t kServerReplyOffset = 100;
+
+}  // namespace
+
+const char RFC2217Codec::kScheme[] = "rfc2217://";
+
+// static
+util::Status RFC2217Codec::parseLocation(const std::string &location,
+                                         std::string *host, int *port) {
+  const util::Status invalid(
+      util::error::INVALID_ARGUMENT,
+      "Invalid location " + location + ", expected " + kScheme + "host:port");
+  const size_t schemeLen = strlen(kScheme);
+  if (location.compare(0, schemeLen, kScheme) != 0) return invalid;
+  std::string hostPort = location.substr(schemeLen);
+  const size_t slash = hostPort.find('/');
+  if (slash != std::string::npos) hostPort.resize(slash);
+  const size_t colon = hostPort.rfind(':');
+  if (colon == std::string::npos || colon == 0 ||
+      colon + 1 == hostPort.length()) {
+    return invalid;
+  }
+  const std::string portStr = hostPort.substr(colon + 1);
+  if (portStr.find_first_not_of("0123456789") != std::string::npos ||
+      portStr.length() > 5) {
+    return invalid;
+  }
+  const int p = atoi(portStr.c_str());
+  if (p <= 0 || p > 65535) return invalid;
+  std::string h = hostPort.substr(0, colon);
+  // IPv6 addresses come in brackets.
+  if (h.length() > 2 && h.front() == '[' && h.back() == ']') {
+    h = h.substr(1, h.length() - 2);
+  } else if (h.find_first_of("[]:") != std::string::npos) {
+    return invalid;
+  }
+  *host = h;
+  *port = p;
+  return util::Status::OK;
+}
+
+// static
+std::string RFC2217Codec::negotiation() {
+  const uint8_t negotiation[] = {
+      kIAC, kWILL, kOptionBinary,          kIAC, kDO,   kOptionBinary,
+      kIAC, kWILL, kOptionSuppressGoAhead, kIAC, kDO,   kOptionSuppressGoAhead,
+      kIAC, kWILL, kOptionComPort,
+  };
+  return std::string((const char *) negotiation, sizeof(negotiation));
+}
+
+// static
+std::string RFC2217Codec::escape(const char *data, size_t size) {
+  std::string r;
+  r.reserve(size + 2);
+  const char *p = data, *end = data + size;
+  while (p < end) {
+    const char *q = (const char *) memchr(p, kIAC, end - p);
+    if (q == nullptr) q = end;
+    r.append(p, q - p);
+    if (q == end) break;
+    r.push_back(char(kIAC));
+    r.push_back(char(kIAC));
+    p = q + 1;
+  }
+  return r;
+}
+
+// static
+std::string RFC2217Codec::comPortRequest(uint8_t cmd,
+                                         const std::string &value) {
+  std::string req;
+  req.push_back(char(kIAC));
+  req.push_back(char(kSB));
+  req.push_back(char(kOptionComPort));
+  req.push_back(char(cmd));
+  req.append(escape(value.data(), value.length()));
+  req.push_back(char(kIAC));
+  req.push_back(char(kSE));
+  return req;
+}
+
+void RFC2217Codec::processInput(const char *p, size_t size, std::string *data,
+                                std::string *response) {
+  const char *end = p + size;
+  while (p < end) {
+    const uint8_t c = *p;
+    switch (state_) {
+      case State::Data: {
+        // Copy the run of data bytes in one go.
+        const char *q = (const char *) memchr(p, kIAC, end - p);
+        if (q == nullptr) q = end;
+        data->append(p, q - p);
+        if (q == end) return;
+        p = q;
+        state_ = State::IAC;
+        break;
+      }
+      case State::IAC:
+        if (c == kIAC) {
+          data->push_back(char(kIAC));
+          state_ = State::Data;
+        } else if (c >= kWILL && c <= kDONT) {
+          optionCmd_ = c;
+          state_ = State::Option;
+        } else if (c == kSB) {
+          sub_.clear();
+          state_ = State::Sub;
+        } else {
+          state_ = State::Data;  // NOP, GA and such carry no data.
+        }
+        break;
+      case State::Option:
+        handleOption(optionCmd_, c, response);
+        state_ = State::Data;
+        break;
+      case State::Sub:
+        if (c == kIAC) {
+          state_ = State::SubIAC;
+        } else {
+          sub_.push_back(char(c));
+        }
+        break;
+      case State::SubIAC:
+        if (c == kSE) {
+          handleSubnegotiation();
+          state_ = State::Data;
+        } else {
+          sub_.push_back(char(c));
+          state_ = State::Sub;
+        }
+        break;
+    }
+    p++;
+  }
+}
+
+bool RFC2217Codec::takeReply(uint8_t cmd, std::string *value) {
+  auto it = replies_.find(cmd);
+  if (it == replies_.end()) return false;
+  value->swap(it->second);
+  replies_.erase(it);
+  return true;
+}
+
+void RFC2217Codec::clearReply(uint8_t cmd) {
+  replies_.erase(cmd);
+}
+
+bool RFC2217Codec::comPortRefused() const {
+  return comPortRefused_;
+}
+
+void RFC2217Codec::handleOption(uint8_t cmd, uint8_t option,
+                                std::string *response) {
+  // We have already offered and requested everything we need,
+  // refuse the rest.
+  const bool known = (option == kOptionBinary ||
+                      option == kOptionSuppressGoAhead ||
+                      (option == kOptionComPort && cmd == kDO));
+  if (cmd == kDONT && option == kOptionComPort) comPortRefused_ = true;
+  if (known || cmd == kWONT || cmd == kDONT) return;
+  response->push_back(char(kIAC));
+  response->push_back(char(cmd == kDO ? kWONT : kDONT));
+  response->push_back(char(option));
+}
+
+void RFC2217Codec::handleSubnegotiation() {
+  if (sub_.length() < 2 || uint8_t(sub_[0]) != kOptionComPort) return;
+  const uint8_t cmd = sub_[1];
+  if (cmd < kServerReplyOffset) return;
+  replies_[cmd - kServerReplyOffset] = sub_.substr(2);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_RFC2217_CODEC_H_
+#define CS_MFT_SRC_RFC2217_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <common/util/status.h>
+
+// Telnet stream (RFC 854) with the Com Port Control Option (RFC 2217), as
+// used by RFC2217Transport. Only deals with bytes, no I/O and no Qt, so that
+// it can be tested on its own.
+class RFC2217Codec {
+ public:
+  static const char kScheme[];
+
+  // Splits rfc2217://host:port into host and port.
+  static util::Status parseLocation(const std::string &location,
+                                    std::string *host, int *port);
+
+  // Option negotiation sent to the server after connecting: binary mode and
+  // suppress go ahead both ways, com port control on our side.
+  static std::string negotiation();
+
+  // Doubles IAC bytes, as required for data and subnegotiation values.
+  static std::string escape(const char *data, size_t size);
+
+  // Subnegotiation that sends com port command cmd with the given value.
+  static std::string comPortRequest(uint8_t cmd, const std::string &value);
+
+  // Consumes bytes received from the server. Data bytes are appended to
+  // data, Telnet commands are stripped. Anything that needs to be sent back,
+  // e.g. refusals of options we don't support, is appended to response.
+  // Commands may be split between calls.
+  void processInput(const char *p, size_t size, std::string *data,
+                    std::string *response);
+
+  // If the server has replied to com port command cmd, moves the reply
+  // value to value and returns true.
+  bool takeReply(uint8_t cmd, std::string *value);
+  void clearReply(uint8_t cmd);
+
+  // Whether the server has refused com port control.
+  bool comPortRefused() const;
+
+ private:
+  void handleOption(uint8_t cmd, uint8_t option, std::string *response);
+  void handleSubnegotiation();
+
+  enum class State {
+    Data,
+    IAC,     // Got IAC, waiting for the command.
+    Option,  // Got IAC WILL/WONT/DO/DONT, waiting for the option.
+    Sub,     // Inside IAC SB ... IAC SE.
+    SubIAC,
+  };
+
+  State state_ = State::Data;
+  uint8_t optionCmd_ = 0;
+  std::string sub_;
+  std::map<uint8_t, std::string> replies_;  // Com port replies, by command.
+  bool comPortRefused_ = false;
+};
+
+#endif /* CS_MFT_SRC_RFC2217_CODEC_H_ */
@@ -5,6 +5,13 @@
 #include <sys/ioctl.h>
 #include <IOKit/serial/ioss.h>
 #endif
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#endif
 
 #include <QCoreApplication>
 #include <QDebug>
@@ -19,6 +26,13 @@
 #define qInfo qWarning
 #endif
 
+namespace {
+
+// Port property holding the rate set by setSpeed bypassing QSerialPort.
+const char kSpeedProperty[] = "mft_speed";
+
+}  // namespace
+
 util::StatusOr<QSerialPortInfo> findSerial(const QString &systemLocation) {
   for (const auto &port : QSerialPortInfo::availablePorts()) {
     if (port.systemLocation() == systemLocation) {
@@ -54,17 +68,53 @@ util::StatusOr<QSerialPort *> connectSerial(const QSerialPortInfo &port,
   if (!st.ok()) {
     return st;
   }
+  // Without this, FTDI adapters hold received data for up to 16 ms,
+  // which adds up quickly on request/response round trips.
+  st = setLowLatency(s.get());
+  if (!st.ok()) {
+    qDebug() << "Low latency mode not enabled:" << st.ToString().c_str();
+  }
   return s.release();
 }
 
+#ifdef Q_OS_LINUX
+namespace {
+
+// Sets the exact rate with termios2 and BOTHER, which works for rates
+// that have no Bxxx constant (e.g. 1.5M, 2M, 3M).
+bool setSpeedTermios2(int fd, int speed) {
+  struct termios2 t;
+  if (ioctl(fd, TCGETS2, &t) < 0) return false;
+  t.c_cflag &= ~CBAUD;
+  t.c_cflag |= BOTHER;
+  t.c_ispeed = t.c_ospeed = speed;
+  if (ioctl(fd, TCSETS2, &t) < 0) return false;
+  if (ioctl(fd, TCGETS2, &t) < 0) return false;
+  // Driver may round the rate, allow for the usual 3% tolerance.
+  return qAbs(int(t.c_ospeed) - speed) <= speed / 33;
+}
+
+}  // namespace
+#endif
+
 util::Status setSpeed(QSerialPort *port, int speed) {
   qInfo() << "Setting" << port->portName() << "speed to" << speed;
   if (!port->setBaudRate(speed)) {
+#ifdef Q_OS_LINUX
+    // QSerialPort may not be able to set non-standard rates, try termios2.
+    if (setSpeedTermios2(port->handle(), speed)) {
+      port->clearError();
+      port->setProperty(kSpeedProperty, speed);
+      return util::Status::OK;
+    }
+#endif
     return util::Status(
         util::error::INTERNAL,
         QCoreApplication::translate("setSpeed", "Failed to set baud rate")
             .toStdString());
   }
+  // QSerialPort knows the rate now.
+  port->setProperty(kSpeedProperty, QVariant());
 #ifdef Q_OS_OSX
   if (ioctl(port->handle(), IOSSIOSPEED, &speed) < 0) {
     return util::Status(
@@ -76,6 +126,31 @@ util::Status setSpeed(QSerialPort *port, int speed) {
   return util::Status::OK;
 }
 
+int getSpeed(const QSerialPort *port) {
+  const QVariant speed = port->property(kSpeedProperty);
+  return speed.isValid() ? speed.toInt() : port->baudRate();
+}
+
+util::Status setLowLatency(QSerialPort *port) {
+#ifdef Q_OS_LINUX
+  struct serial_struct ss;
+  if (ioctl(port->handle(), TIOCGSERIAL, &ss) < 0) {
+    return QS(util::error::UNIMPLEMENTED,
+              QObject::tr("TIOCGSERIAL failed: %1").arg(strerror(errno)));
+  }
+  if (ss.flags & ASYNC_LOW_LATENCY) return util::Status::OK;
+  ss.flags |= ASYNC_LOW_LATENCY;
+  if (ioctl(port->handle(), TIOCSSERIAL, &ss) < 0) {
+    return QS(util::error::UNIMPLEMENTED,
+              QObject::tr("TIOCSSERIAL failed: %1").arg(strerror(errno)));
+  }
+  return util::Status::OK;
+#else
+  (void) port;
+  return QS(util::error::UNIMPLEMENTED, "not supported on this platform");
+#endif
+}
+
 util::StatusOr<QSerialPort *> connectSerial(const QString &systemLocation,
                                             int speed) {
   const auto qspi = findSerial(systemLocation);
@@ -21,4 +21,12 @@ util::StatusOr<QSerialPort *> connectSerial(const QString &systemLocation,
 
 util::Status setSpeed(QSerialPort *port, int speed);
 
+// Returns the rate last set with setSpeed. Unlike QSerialPort::baudRate(),
+// this includes rates set directly with the driver.
+int getSpeed(const QSerialPort *port);
+
+// Asks the driver to deliver received data immediately instead of
+// batching it (ASYNC_LOW_LATENCY). Only supported on Linux.
+util::Status setLowLatency(QSerialPort *port);
+
 #endif /* CS_MFT_SRC_SERIAL_H_ */
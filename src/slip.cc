@@ -1,6 +1,17 @@
 #include "slip.h"
 
+#include <errno.h>
+#include <string.h>
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <iterator>
+
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QThread>
 
 #include "status_qt.h"
 
@@ -12,29 +23,68 @@ const unsigned char SLIPEscape = 0xDB;
 const unsigned char SLIPEscapeFrameDelimiter = 0xDC;
 const unsigned char SLIPEscapeEscape = 0xDD;
 
-util::Status send(QSerialPort *port, const QByteArray &data, int timeoutMs) {
+namespace {
+
+// Non-zero for bytes that need escaping, the value is the escaped byte.
+struct EscapeTable {
+  EscapeTable() {
+    std::fill(std::begin(t), std::end(t), 0);
+    t[SLIPFrameDelimiter] = SLIPEscapeFrameDelimiter;
+    t[SLIPEscape] = SLIPEscapeEscape;
+  }
+  unsigned char t[256];
+};
+
+const EscapeTable escapeTable;
+
+}  // namespace
+
+QByteArray encode(const QByteArray &data) {
+  QByteArray frame;
+  encode(data, &frame);
+  return frame;
+}
+
+void encode(const QByteArray &data, QByteArray *out) {
+  const unsigned char *p = (const unsigned char *) data.constData();
+  const unsigned char *end = p + data.length();
+  int numEscapes = 0;
+  for (const unsigned char *q = p; q < end; q++) {
+    if (escapeTable.t[*q]) numEscapes++;
+  }
+  QByteArray &frame = *out;
+  // Once capacity has been reserved, resizing to 0 keeps the memory.
+  frame.resize(0);
+  frame.reserve(data.length() + numEscapes + 2);
+  frame.append(SLIPFrameDelimiter);
+  while (p < end) {
+    // Copy the run of bytes that don't need escaping in one go.
+    const unsigned char *q = p;
+    while (q < end && !escapeTable.t[*q]) q++;
+    frame.append((const char *) p, q - p);
+    if (q == end) break;
+    frame.append(SLIPEscape);
+    frame.append(escapeTable.t[*q]);
+    p = q + 1;
+  }
+  frame.append(SLIPFrameDelimiter);
+}
+
+util::Status send(Transport *port, const QByteArray &data, int timeoutMs) {
+  QByteArray frame;
+  return send(port, data, &frame, timeoutMs);
+}
+
+util::Status send(Transport *port, const QByteArray &data, QByteArray *buf,
+                  int timeoutMs) {
   const QString prefix = QString("SLIP::send(%1, %2, %3):")
                              .arg(port->portName())
                              .arg(data.length())
                              .arg(timeoutMs);
   qDebug() << prefix << "=>" << data.toHex();
-  bool ok = port->putChar(SLIPFrameDelimiter);
-  for (int i = 0; ok && i < data.length(); i++) {
-    switch ((unsigned char) data[i]) {
-      case SLIPFrameDelimiter:
-        ok = ok && port->putChar(SLIPEscape);
-        ok = ok && port->putChar(SLIPEscapeFrameDelimiter);
-        break;
-      case SLIPEscape:
-        ok = ok && port->putChar(SLIPEscape);
-        ok = ok && port->putChar(SLIPEscapeEscape);
-        break;
-      default:
-        ok = ok && port->putChar(data[i]);
-        break;
-    }
-  }
-  ok = ok && port->putChar(SLIPFrameDelimiter);
+  encode(data, buf);
+  const QByteArray &frame = *buf;
+  bool ok = (port->write(frame) == frame.length());
   ok = ok && port->waitForBytesWritten(timeoutMs);
   if (!ok) {
     return QS(util::error::UNAVAILABLE, prefix + " " + port->errorString());
@@ -42,59 +92,244 @@ util::Status send(QSerialPort *port, const QByteArray &data, int timeoutMs) {
   return util::Status::OK;
 }
 
-util::StatusOr<QByteArray> recv(QSerialPort *port, int timeoutMs) {
-  const QString prefix =
-      QString("SLIP::recv(%1, %2): ").arg(port->portName()).arg(timeoutMs);
-  QByteArray ret;
-  char c = 0;
-  // Skip everything before the frame start.
-  do {
-    if (port->bytesAvailable() == 0 && !port->waitForReadyRead(timeoutMs)) {
-      return QS(util::error::UNAVAILABLE,
-                prefix + "no data 1: " + port->errorString());
+// static
+Decoder *Decoder::forPort(Transport *port) {
+  Decoder *d =
+      port->findChild<Decoder *>(QString(), Qt::FindDirectChildrenOnly);
+  if (d == nullptr) d = new Decoder(port);
+  return d;
+}
+
+Decoder::Decoder(Transport *port) : QObject(port), port_(port) {
+  clock_.start();
+  connect(port_, &Transport::aboutToClose, this, &Decoder::stopAsync,
+          Qt::DirectConnection);
+}
+
+Decoder::~Decoder() {
+  // Port may be half-destroyed by now, use the saved descriptor.
+  if (async_) IOReactor::instance()->remove(fd_);
+}
+
+util::StatusOr<QByteArray> Decoder::recv(int timeoutMs) {
+  const QString prefix = QString("SLIP::Decoder::recv(%1, %2): ")
+                             .arg(port_->portName())
+                             .arg(timeoutMs);
+  const qint64 startMs = clock_.elapsed();
+  while (!numFrames_.tryAcquire()) {
+    if (overflow_.exchange(false)) {
+      return QS(util::error::RESOURCE_EXHAUSTED,
+                prefix + "frame queue overflow");
     }
-    if (!port->getChar(&c)) {
-      return QS(util::error::UNAVAILABLE,
-                prefix + "failed to read prefix: " + port->errorString());
+    // Keep waiting as long as frame data keeps coming.
+    const qint64 remainingMs =
+        std::max(startMs, qint64(lastDataAtMs_)) + timeoutMs - clock_.elapsed();
+    if (async_) {
+      if (remainingMs > 0 && numFrames_.tryAcquire(1, remainingMs)) break;
+      if (clock_.elapsed() - lastDataAtMs_ >= timeoutMs) {
+        return QS(util::error::UNAVAILABLE, prefix + "no data");
+      }
+      continue;
     }
-  } while ((unsigned char) c != SLIPFrameDelimiter);
-  for (;;) {
-    if (port->bytesAvailable() == 0 && !port->waitForReadyRead(timeoutMs)) {
+    if (port_->bytesAvailable() == 0 &&
+        (remainingMs <= 0 || !port_->waitForReadyRead(remainingMs))) {
       return QS(util::error::UNAVAILABLE,
-                prefix + "no data 2: " + port->errorString());
+                prefix + "no data: " + port_->errorString());
+    }
+    const QByteArray data = port_->readAll();
+    feed(data.constData(), data.length());
+  }
+  util::StatusOr<QByteArray> res;
+  frames_.pop(&res);
+  if (res.ok()) {
+    qDebug() << prefix << "<=" << res.ValueOrDie().toHex();
+  } else {
+    res = QSP(prefix + "bad frame", res.status());
+  }
+  return res;
+}
+
+void Decoder::flush() {
+  if (!async_) {
+    port_->readAll();
+    resetDecoding();
+    dropFrames();
+    return;
+  }
+  // Decoding state belongs to the reactor thread, it must not be decoding
+  // while the state is reset. Data that has arrived but not been read yet
+  // is discarded here too, otherwise the reactor would decode it after the
+  // flush and a stale response could be taken for the next one.
+  IOReactor::instance()->runExclusive([this]() {
+#ifdef Q_OS_UNIX
+    char buf[4096];
+    while (true) {
+      const ssize_t n = ::read(fd_, buf, sizeof(buf));
+      if (n > 0) continue;
+      if (n < 0 && errno == EINTR) continue;
+      // Read errors are left for the reactor to report.
+      break;
     }
-    if (!port->getChar(&c)) {
-      return QS(util::error::UNAVAILABLE, prefix + "failed to read next char");
+#endif
+    resetDecoding();
+  });
+  // Reactor may have decoded more frames meanwhile, they are stale too.
+  dropFrames();
+}
+
+void Decoder::resetDecoding() {
+  state_ = State::Idle;
+  frame_.clear();
+}
+
+void Decoder::dropFrames() {
+  util::StatusOr<QByteArray> frame;
+  while (numFrames_.tryAcquire()) frames_.pop(&frame);
+  overflow_ = false;
+}
+
+int Decoder::waitForQuiet(int quietMs, int timeoutMs) {
+  QElapsedTimer timer;
+  timer.start();
+  qint64 lastDataAt = -1;
+  quint64 numBytes = bytesReceived_;
+  while (lastDataAt < 0 || timer.elapsed() - lastDataAt < quietMs) {
+    if (timer.elapsed() >= timeoutMs) return -1;
+    if (async_) {
+      QThread::msleep(1);
+      if (bytesReceived_ == numBytes) continue;
+      numBytes = bytesReceived_;
+    } else {
+      if (port_->bytesAvailable() == 0 && !port_->waitForReadyRead(1)) {
+        continue;
+      }
+      const QByteArray data = port_->readAll();
+      feed(data.constData(), data.length());
     }
-    switch ((unsigned char) c) {
-      case SLIPFrameDelimiter:
-        // End of frame.
-        qDebug() << prefix << "<=" << ret.toHex();
-        return ret;
-      case SLIPEscape:
-        if (port->bytesAvailable() == 0 && !port->waitForReadyRead(timeoutMs)) {
-          return QS(util::error::UNAVAILABLE,
-                    prefix + "no data 3: " + port->errorString());
-        }
-        if (!port->getChar(&c)) {
-          return QS(util::error::UNAVAILABLE,
-                    prefix + "failed to read next char");
+    lastDataAt = timer.elapsed();
+  }
+  return lastDataAt;
+}
+
+util::Status Decoder::startAsync() {
+  if (async_) return util::Status::OK;
+  const int fd = port_->descriptor();
+  if (fd < 0) {
+    return QS(util::error::UNIMPLEMENTED, "port does not support polling");
+  }
+  port_->setExternalReads(true);
+  // Whatever the port has already buffered is not going to be seen by the
+  // reactor.
+  const QByteArray data = port_->readAll();
+  feed(data.constData(), data.length());
+  util::Status st = IOReactor::instance()->add(fd, this);
+  if (!st.ok()) {
+    port_->setExternalReads(false);
+    return st;
+  }
+  fd_ = fd;
+  async_ = true;
+  return util::Status::OK;
+}
+
+void Decoder::stopAsync() {
+  if (!async_) return;
+  IOReactor::instance()->remove(fd_);
+  port_->setExternalReads(false);
+  async_ = false;
+  fd_ = -1;
+}
+
+bool Decoder::readable(int fd) {
+#ifdef Q_OS_UNIX
+  char buf[4096];
+  while (true) {
+    const ssize_t n = ::read(fd, buf, sizeof(buf));
+    if (n > 0) {
+      feed(buf, n);
+      bytesReceived_ += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    enqueue(QS(util::error::UNAVAILABLE,
+               QString("read failed: %1")
+                   .arg(n == 0 ? "end of file" : strerror(errno))));
+    return false;
+  }
+#else
+  Q_UNUSED(fd);
+  return false;
+#endif
+}
+
+void Decoder::enqueue(const util::StatusOr<QByteArray> &frame) {
+  if (frames_.push(frame)) {
+    numFrames_.release();
+  } else {
+    overflow_ = true;
+  }
+}
+
+void Decoder::feed(const char *data, qint64 len) {
+  const unsigned char *p = (const unsigned char *) data;
+  const unsigned char *end = p + len;
+  // Noise between frames does not count as data for recv's timeout.
+  if (state_ != State::Idle) lastDataAtMs_ = clock_.elapsed();
+  while (p < end) {
+    switch (state_) {
+      case State::Idle: {
+        // Skip everything before the frame start.
+        const void *start = memchr(p, SLIPFrameDelimiter, end - p);
+        if (start == nullptr) return;
+        p = (const unsigned char *) start + 1;
+        state_ = State::Frame;
+        lastDataAtMs_ = clock_.elapsed();
+        break;
+      }
+      case State::Frame: {
+        // Copy the run of bytes that don't need unescaping in one go.
+        const unsigned char *q = p;
+        while (q < end && *q != SLIPFrameDelimiter && *q != SLIPEscape) q++;
+        frame_.append((const char *) p, q - p);
+        p = q;
+        if (p == end) return;
+        if (*p == SLIPFrameDelimiter) {
+          // An empty frame is a back-to-back delimiter, treat it as a start.
+          if (frame_.isEmpty()) {
+            p++;
+            break;
+          }
+          enqueue(frame_);
+          frame_.clear();
+          state_ = State::Idle;
+        } else {
+          state_ = State::Escape;
         }
-        switch ((unsigned char) c) {
+        p++;
+        break;
+      }
+      case State::Escape: {
+        switch (*p) {
           case SLIPEscapeFrameDelimiter:
-            ret.append(SLIPFrameDelimiter);
+            frame_.append(SLIPFrameDelimiter);
+            state_ = State::Frame;
             break;
           case SLIPEscapeEscape:
-            ret.append(SLIPEscape);
+            frame_.append(SLIPEscape);
+            state_ = State::Frame;
             break;
           default:
-            return QS(util::error::UNAVAILABLE,
-                      prefix + "invalid escape sequence: " + int(c));
+            enqueue(
+                QS(util::error::UNAVAILABLE,
+                   QString("invalid escape sequence: %1").arg(int(*p))));
+            frame_.clear();
+            state_ = State::Idle;
+            break;
         }
+        p++;
         break;
-      default:
-        ret.append(c);
-        break;
+      }
     }
   }
 }
@@ -6,17 +6,103 @@
 #ifndef CS_MFT_SRC_SLIP_H_
 #define CS_MFT_SRC_SLIP_H_
 
-#include <QSerialPort>
+#include <atomic>
+
 #include <QByteArray>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QSemaphore>
 
 #include <common/util/statusor.h>
 
+#include "io_reactor.h"
+#include "spsc_queue.h"
+#include "transport.h"
+
 namespace SLIP {
 
-util::StatusOr<QByteArray> recv(QSerialPort *in, int timeout = 500);
-util::Status send(QSerialPort *out, const QByteArray &bytes,
+// Returns data escaped and wrapped in frame delimiters.
+QByteArray encode(const QByteArray &data);
+// Same, but stores the frame in *frame, reusing its memory.
+void encode(const QByteArray &data, QByteArray *frame);
+
+util::Status send(Transport *out, const QByteArray &bytes,
+                  int timeoutMs = 500);
+// Same, but encodes into *buf, which callers can keep between calls to avoid
+// allocating a frame every time.
+util::Status send(Transport *out, const QByteArray &bytes, QByteArray *buf,
                   int timeoutMs = 500);
 
+// Incremental decoder attached to a port. Consumes whatever data is
+// available and keeps partially received frames between calls, so frames
+// that arrive back to back are not lost.
+//
+// By default, data is read and decoded by recv() on the caller's thread.
+// After startAsync() it is read and decoded on the I/O reactor thread as soon
+// as it arrives, and recv() only waits for decoded frames.
+class Decoder : public QObject, private IOReactor::Handler {
+  Q_OBJECT
+ public:
+  // Returns the decoder of the port, creating one if necessary.
+  // Decoder is owned by the port.
+  static Decoder *forPort(Transport *port);
+  ~Decoder();
+
+  // Returns the next frame. Fails if no frame data arrives for timeoutMs,
+  // noise between frames does not count.
+  util::StatusOr<QByteArray> recv(int timeoutMs = 500);
+
+  // Discards everything received so far, including data waiting in the port.
+  void flush();
+
+  // Waits for a burst of data, such as a boot banner, to arrive and end,
+  // i.e. for quietMs without data after receiving some. Returns the time
+  // from the call until the end of the burst, or -1 if nothing arrived or
+  // data was still coming after timeoutMs.
+  int waitForQuiet(int quietMs, int timeoutMs);
+
+  // Moves reading to the I/O reactor. Fails if the port does not support it,
+  // in which case decoder keeps working synchronously. Reading is moved back
+  // when the port is about to close, before its descriptor can be reused.
+  util::Status startAsync();
+  void stopAsync();
+
+ private:
+  explicit Decoder(Transport *port);
+
+  bool readable(int fd) override;
+  void feed(const char *data, qint64 len);
+  // Resets decoding state, on the thread that decodes.
+  void resetDecoding();
+  // Drops decoded frames, on the thread that calls recv: it is the only
+  // consumer of the queue.
+  void dropFrames();
+  void enqueue(const util::StatusOr<QByteArray> &frame);
+
+  enum class State {
+    Idle,  // Waiting for frame start.
+    Frame,
+    Escape,
+  };
+
+  Transport *port_;
+
+  // Decoding state, owned by the reactor thread while async.
+  State state_ = State::Idle;
+  QByteArray frame_;
+
+  SPSCQueue<util::StatusOr<QByteArray>, 256> frames_;
+  QSemaphore numFrames_;
+  std::atomic<bool> overflow_{false};
+  std::atomic<quint64> bytesReceived_{0};
+  // Time of the last frame data received, on clock_.
+  QElapsedTimer clock_;
+  std::atomic<qint64> lastDataAtMs_{0};
+
+  bool async_ = false;
+  int fd_ = -1;
+};
+
 }  // namespace SLIP
 
 #endif /* CS_MFT_SRC_SLIP_H_ */
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_SPSC_QUEUE_H_
+#define CS_MFT_SRC_SPSC_QUEUE_H_
+
+#include <stddef.h>
+
+#include <atomic>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// Capacity must be a power of 2.
+template <class T, size_t Capacity>
+class SPSCQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "capacity must be a power of 2");
+
+ public:
+  SPSCQueue() : head_(0), tail_(0) {
+  }
+
+  // Producer side. Returns false if the queue is full.
+  bool push(const T &v) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == Capacity) return false;
+    items_[tail & (Capacity - 1)] = v;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the queue is empty.
+  bool pop(T *v) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+    T &item = items_[head & (Capacity - 1)];
+    *v = item;
+    item = T();  // Don't keep the data alive until the slot is reused.
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  T items_[Capacity];
+  std::atomic<size_t> head_;  // Written by the consumer.
+  std::atomic<size_t> tail_;  // Written by the producer.
+
+  SPSCQueue(const SPSCQueue &other) = delete;
+};
+
+#endif /* CS_MFT_SRC_SPSC_QUEUE_H_ */
@@ -29,10 +29,13 @@ QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
 
 HEADERS += \
   app_init.h \
+  batch_flasher.h \
   cc3200.h \
   cli.h \
+  daemon.h \
   config.h \
   esp8266.h \
+  esp_digest_cache.h \
   esp_flasher_client.h \
   esp_rom_client.h \
   file_downloader.h \
@@ -40,20 +43,28 @@ HEADERS += \
   fs.h \
   fw_bundle.h \
   fw_client.h \
+  io_reactor.h \
   log.h \
   prompter.h \
+  rfc2217.h \
+  rfc2217_codec.h \
   serial.h \
   sigsource.h \
   slip.h \
-  status_qt.h
+  spsc_queue.h \
+  status_qt.h \
+  transport.h
 
 SOURCES += \
   app_init.cc \
+  batch_flasher.cc \
   build_info.cc \
   cc3200.cc \
   cli.cc \
+  daemon.cc \
   config.cc \
   esp8266.cc \
+  esp_digest_cache.cc \
   esp_flasher_client.cc \
   esp_rom_client.cc \
   file_downloader.cc \
@@ -62,10 +73,14 @@ SOURCES += \
   fw_bundle.cc \
   fw_bundle_zip.cc \
   fw_client.cc \
+  io_reactor.cc \
   log.cc \
+  rfc2217.cc \
+  rfc2217_codec.cc \
   serial.cc \
   slip.cc \
-  status_qt.cc
+  status_qt.cc \
+  transport.cc
 
 CONFIG(cli) {
   QT -= gui
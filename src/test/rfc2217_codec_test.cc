@@ -0,0 +1,164 @@
+#include "rfc2217_codec.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+const char kIAC = '\xff';
+const char kSB = '\xfa';
+const char kSE = '\xf0';
+const char kWILL = '\xfb';
+const char kWONT = '\xfc';
+const char kDO = '\xfd';
+const char kDONT = '\xfe';
+const char kComPort = 44;
+
+std::string bytes(std::initializer_list<char> b) {
+  return std::string(b);
+}
+
+// Feeds input to the codec one byte at a time, to check that commands split
+// between reads are handled.
+void feedBytewise(RFC2217Codec *c, const std::string &input, std::string *data,
+                  std::string *response) {
+  for (char b : input) c->processInput(&b, 1, data, response);
+}
+
+}  // namespace
+
+TEST(RFC2217CodecTest, ParseLocation) {
+  std::string host;
+  int port = 0;
+  EXPECT_TRUE(
+      RFC2217Codec::parseLocation("rfc2217://example.com:2217", &host, &port)
+          .ok());
+  EXPECT_EQ("example.com", host);
+  EXPECT_EQ(2217, port);
+  EXPECT_TRUE(
+      RFC2217Codec::parseLocation("rfc2217://10.0.0.1:4000/", &host, &port)
+          .ok());
+  EXPECT_EQ("10.0.0.1", host);
+  EXPECT_EQ(4000, port);
+  EXPECT_TRUE(
+      RFC2217Codec::parseLocation("rfc2217://[::1]:7000", &host, &port).ok());
+  EXPECT_EQ("::1", host);
+  EXPECT_EQ(7000, port);
+}
+
+TEST(RFC2217CodecTest, ParseLocationInvalid) {
+  std::string host = "unchanged";
+  int port = 1;
+  for (const char *location :
+       {"/dev/ttyUSB0", "telnet://host:23", "rfc2217://", "rfc2217://host",
+        "rfc2217://host:", "rfc2217://:2217", "rfc2217://host:0",
+        "rfc2217://host:65536", "rfc2217://host:22x", "rfc2217://::1:2217"}) {
+    util::Status st = RFC2217Codec::parseLocation(location, &host, &port);
+    EXPECT_EQ(util::error::INVALID_ARGUMENT, st.error_code()) << location;
+  }
+  EXPECT_EQ("unchanged", host);
+  EXPECT_EQ(1, port);
+}
+
+TEST(RFC2217CodecTest, Escape) {
+  EXPECT_EQ("", RFC2217Codec::escape("", 0));
+  EXPECT_EQ("abc", RFC2217Codec::escape("abc", 3));
+  const std::string in = bytes({kIAC, 'a', kIAC, kIAC});
+  EXPECT_EQ(bytes({kIAC, kIAC, 'a', kIAC, kIAC, kIAC, kIAC}),
+            RFC2217Codec::escape(in.data(), in.length()));
+}
+
+TEST(RFC2217CodecTest, ComPortRequest) {
+  // Set baud rate to 0x0001c2ff, value bytes equal to IAC are doubled.
+  const std::string value = bytes({0, 1, '\xc2', kIAC});
+  EXPECT_EQ(bytes({kIAC, kSB, kComPort, 1, 0, 1, '\xc2', kIAC, kIAC, kIAC,
+                   kSE}),
+            RFC2217Codec::comPortRequest(1, value));
+}
+
+TEST(RFC2217CodecTest, DataWithEscapedIAC) {
+  RFC2217Codec c;
+  std::string data, response;
+  const std::string in = bytes({'a', kIAC, kIAC, 'b', kIAC, kIAC});
+  c.processInput(in.data(), in.length(), &data, &response);
+  EXPECT_EQ(bytes({'a', kIAC, 'b', kIAC}), data);
+  EXPECT_EQ("", response);
+}
+
+TEST(RFC2217CodecTest, DataSplitInsideEscape) {
+  RFC2217Codec c;
+  std::string data, response;
+  feedBytewise(&c, bytes({'a', kIAC, kIAC, 'b'}), &data, &response);
+  EXPECT_EQ(bytes({'a', kIAC, 'b'}), data);
+}
+
+TEST(RFC2217CodecTest, CommandsAreStripped) {
+  RFC2217Codec c;
+  std::string data, response;
+  // NOP, then acceptance of the options we asked for.
+  const std::string in = bytes({'x', kIAC, '\xf1', kIAC, kDO, 0, 'y', kIAC,
+                                kWILL, 3, kIAC, kDO, kComPort, 'z'});
+  c.processInput(in.data(), in.length(), &data, &response);
+  EXPECT_EQ("xyz", data);
+  EXPECT_EQ("", response);
+  EXPECT_FALSE(c.comPortRefused());
+}
+
+TEST(RFC2217CodecTest, UnknownOptionsAreRefused) {
+  RFC2217Codec c;
+  std::string data, response;
+  // Echo (1) and terminal type (24).
+  feedBytewise(&c, bytes({kIAC, kDO, 24, kIAC, kWILL, 1, kIAC, kWONT, 5}),
+               &data, &response);
+  EXPECT_EQ("", data);
+  EXPECT_EQ(bytes({kIAC, kWONT, 24, kIAC, kDONT, 1}), response);
+}
+
+TEST(RFC2217CodecTest, ComPortRefused) {
+  RFC2217Codec c;
+  std::string data, response;
+  const std::string in = bytes({kIAC, kDONT, kComPort});
+  c.processInput(in.data(), in.length(), &data, &response);
+  EXPECT_TRUE(c.comPortRefused());
+  EXPECT_EQ("", response);
+}
+
+TEST(RFC2217CodecTest, ComPortReply) {
+  RFC2217Codec c;
+  std::string data, response, value;
+  EXPECT_FALSE(c.takeReply(1, &value));
+  // Reply to set baud rate (1 + 100), with an escaped IAC in the value,
+  // surrounded by data.
+  const std::string in = bytes({'a', kIAC, kSB, kComPort, 101, 0, 1, '\xc2',
+                                kIAC, kIAC, kIAC, kSE, 'b'});
+  feedBytewise(&c, in, &data, &response);
+  EXPECT_EQ("ab", data);
+  EXPECT_TRUE(c.takeReply(1, &value));
+  EXPECT_EQ(bytes({0, 1, '\xc2', kIAC}), value);
+  // Taken.
+  EXPECT_FALSE(c.takeReply(1, &value));
+}
+
+TEST(RFC2217CodecTest, IgnoredSubnegotiations) {
+  RFC2217Codec c;
+  std::string data, response, value;
+  // Another option, a server-to-client command rather than a reply, and a
+  // truncated one.
+  const std::string in =
+      bytes({kIAC, kSB, 24, 101, 5, kIAC, kSE, kIAC, kSB, kComPort, 5, 1,
+             kIAC, kSE, kIAC, kSB, kComPort, kIAC, kSE});
+  c.processInput(in.data(), in.length(), &data, &response);
+  EXPECT_EQ("", data);
+  EXPECT_FALSE(c.takeReply(1, &value));
+  EXPECT_FALSE(c.takeReply(5, &value));
+}
+
+TEST(RFC2217CodecTest, ClearReply) {
+  RFC2217Codec c;
+  std::string data, response, value;
+  const std::string in = bytes({kIAC, kSB, kComPort, 105, 8, kIAC, kSE});
+  c.processInput(in.data(), in.length(), &data, &response);
+  c.clearReply(5);
+  EXPECT_FALSE(c.takeReply(5, &value));
+}
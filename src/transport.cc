@@ -0,0 +1,177 @@
+#include "transport.h"
+
+#include <memory>
+
+#include <QSerialPort>
+#include <QSerialPortInfo>
+
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+
+#include "rfc2217.h"
+#include "serial.h"
+
+SerialTransport::SerialTransport(QSerialPort *port, QObject *parent)
+    : Transport(parent), port_(port) {
+  connect(port_, &QSerialPort::readyRead, this, &Transport::readyRead);
+  connect(port_, &QSerialPort::aboutToClose, this, &Transport::aboutToClose);
+}
+
+SerialTransport::~SerialTransport() {
+  // If the port is owned by this, it is closed after signals have been
+  // disconnected, so give the users of the descriptor a chance now.
+  emit aboutToClose();
+}
+
+// static
+SerialTransport *SerialTransport::forPort(QSerialPort *port) {
+  SerialTransport *t =
+      port->findChild<SerialTransport *>(QString(), Qt::FindDirectChildrenOnly);
+  if (t == nullptr) t = new SerialTransport(port, port);
+  return t;
+}
+
+QString SerialTransport::portName() const {
+  return port_->portName();
+}
+
+QString SerialTransport::errorString() const {
+  if (externalReads_ && !writeError_.isEmpty()) return writeError_;
+  return port_->errorString();
+}
+
+qint64 SerialTransport::bytesAvailable() const {
+  return port_->bytesAvailable();
+}
+
+QByteArray SerialTransport::read(qint64 maxSize) {
+  return port_->read(maxSize);
+}
+
+QByteArray SerialTransport::readAll() {
+  return port_->readAll();
+}
+
+qint64 SerialTransport::write(const char *data, qint64 size) {
+  // QSerialPort reads input while waiting for its writes to complete.
+  if (externalReads_) return writeDescriptor(data, size);
+  return port_->write(data, size);
+}
+
+bool SerialTransport::waitForReadyRead(int msecs) {
+  if (externalReads_) return false;
+  return port_->waitForReadyRead(msecs);
+}
+
+bool SerialTransport::waitForBytesWritten(int msecs) {
+  // Direct writes complete before returning.
+  if (externalReads_) return true;
+  return port_->waitForBytesWritten(msecs);
+}
+
+bool SerialTransport::clear() {
+  return port_->clear();
+}
+
+qint32 SerialTransport::baudRate() const {
+  return getSpeed(port_);
+}
+
+util::Status SerialTransport::setBaudRate(qint32 baudRate) {
+  return setSpeed(port_, baudRate);
+}
+
+bool SerialTransport::setDataTerminalReady(bool set) {
+  return port_->setDataTerminalReady(set);
+}
+
+bool SerialTransport::setRequestToSend(bool set) {
+  return port_->setRequestToSend(set);
+}
+
+bool SerialTransport::setBreakEnabled(bool set) {
+  return port_->setBreakEnabled(set);
+}
+
+QString SerialTransport::adapterId() const {
+  const QSerialPortInfo info(*port_);
+  if (!info.hasVendorIdentifier() || !info.hasProductIdentifier()) {
+    return portName();
+  }
+  return QString("usb-%1-%2-%3")
+      .arg(info.vendorIdentifier(), 4, 16, QChar('0'))
+      .arg(info.productIdentifier(), 4, 16, QChar('0'))
+      .arg(info.serialNumber());
+}
+
+int SerialTransport::descriptor() const {
+#ifdef Q_OS_LINUX
+  return port_->handle();
+#else
+  return -1;
+#endif
+}
+
+void SerialTransport::setExternalReads(bool set) {
+  if (set == externalReads_) return;
+  // Let the port finish its own writes while it is still allowed to read.
+  if (set && port_->bytesToWrite() > 0) port_->waitForBytesWritten(1000);
+  writeError_.clear();
+  externalReads_ = set;
+}
+
+// Writes everything to the descriptor, waiting for space in the driver's
+// buffer if necessary. Data being received meanwhile is not affected.
+qint64 SerialTransport::writeDescriptor(const char *data, qint64 size) {
+#ifdef Q_OS_LINUX
+  const int kStallTimeoutMs = 5000;
+  const int fd = port_->handle();
+  qint64 written = 0;
+  while (written < size) {
+    const ssize_t n = ::write(fd, data + written, size - written);
+    if (n > 0) {
+      written += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      writeError_ = QString("write failed: %1").arg(strerror(errno));
+      return -1;
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    const int r = poll(&pfd, 1, kStallTimeoutMs);
+    if (r == 0) {
+      writeError_ = "write timed out";
+      return -1;
+    } else if (r < 0 && errno != EINTR) {
+      writeError_ = QString("poll failed: %1").arg(strerror(errno));
+      return -1;
+    }
+  }
+  return written;
+#else
+  Q_UNUSED(data);
+  Q_UNUSED(size);
+  return -1;
+#endif
+}
+
+util::StatusOr<Transport *> connectTransport(const QString &location,
+                                             int speed) {
+  if (location.startsWith(RFC2217Codec::kScheme)) {
+    return RFC2217Transport::open(location, speed);
+  }
+  auto sp = connectSerial(location, speed);
+  if (!sp.ok()) return sp.status();
+  QSerialPort *port = sp.ValueOrDie();
+  std::unique_ptr<SerialTransport> t(new SerialTransport(port));
+  port->setParent(t.get());
+  return t.release();
+}
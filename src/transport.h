@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_TRANSPORT_H_
+#define CS_MFT_SRC_TRANSPORT_H_
+
+#include <QByteArray>
+#include <QObject>
+#include <QString>
+
+#include <common/util/statusor.h>
+
+class QSerialPort;
+
+// Byte stream to a device with modem control lines. Protocol code (ROM and
+// stub clients, SLIP, CC3200 boot loader packets) talks to devices through
+// this, so that a device can be attached either locally or to a remote host.
+// Method names and semantics follow QSerialPort.
+class Transport : public QObject {
+  Q_OBJECT
+
+ public:
+  virtual ~Transport() {
+  }
+
+  virtual QString portName() const = 0;
+  virtual QString errorString() const = 0;
+
+  virtual qint64 bytesAvailable() const = 0;
+  virtual QByteArray read(qint64 maxSize) = 0;
+  virtual QByteArray readAll() = 0;
+  virtual qint64 write(const char *data, qint64 size) = 0;
+  qint64 write(const QByteArray &data) {
+    return write(data.constData(), data.length());
+  }
+  virtual bool waitForReadyRead(int msecs) = 0;
+  virtual bool waitForBytesWritten(int msecs) = 0;
+  // Discards data in both directions.
+  virtual bool clear() = 0;
+
+  virtual qint32 baudRate() const = 0;
+  virtual util::Status setBaudRate(qint32 baudRate) = 0;
+  virtual bool setDataTerminalReady(bool set) = 0;
+  virtual bool setRequestToSend(bool set) = 0;
+  virtual bool setBreakEnabled(bool set) = 0;
+
+  // Identifies the adapter the device is attached to, for remembering things
+  // about the way it is wired.
+  virtual QString adapterId() const {
+    return portName();
+  }
+
+  // File descriptor that can be polled for input, -1 if there is none.
+  virtual int descriptor() const {
+    return -1;
+  }
+  // While set, input is read directly from descriptor() by someone else and
+  // the transport must not read from the device, not even while writing.
+  // Read methods must not be used.
+  virtual void setExternalReads(bool set) {
+    Q_UNUSED(set);
+  }
+
+ signals:
+  void readyRead();
+  // Emitted before the device is closed, while descriptor() is still valid.
+  void aboutToClose();
+
+ protected:
+  Transport(QObject *parent) : QObject(parent) {
+  }
+};
+
+// Transport for a local serial port.
+class SerialTransport : public Transport {
+  Q_OBJECT
+
+ public:
+  explicit SerialTransport(QSerialPort *port, QObject *parent = nullptr);
+  ~SerialTransport() override;
+
+  // Returns the transport of the port, creating one if necessary.
+  // Transport is owned by the port.
+  static SerialTransport *forPort(QSerialPort *port);
+
+  QSerialPort *port() const {
+    return port_;
+  }
+
+  QString portName() const override;
+  QString errorString() const override;
+
+  qint64 bytesAvailable() const override;
+  QByteArray read(qint64 maxSize) override;
+  QByteArray readAll() override;
+  using Transport::write;
+  qint64 write(const char *data, qint64 size) override;
+  bool waitForReadyRead(int msecs) override;
+  bool waitForBytesWritten(int msecs) override;
+  bool clear() override;
+
+  qint32 baudRate() const override;
+  util::Status setBaudRate(qint32 baudRate) override;
+  bool setDataTerminalReady(bool set) override;
+  bool setRequestToSend(bool set) override;
+  bool setBreakEnabled(bool set) override;
+  // USB vendor, product and serial number, if available. Unlike the port
+  // name, these stay the same when the adapter is plugged in elsewhere.
+  QString adapterId() const override;
+
+  int descriptor() const override;
+  void setExternalReads(bool set) override;
+
+ private:
+  qint64 writeDescriptor(const char *data, qint64 size);
+
+  QSerialPort *port_;
+  bool externalReads_ = false;
+  QString writeError_;
+};
+
+// Opens a transport. Location is either a serial port or
+// rfc2217://host:port for a serial port exported by a remote host
+// (e.g. ser2net). Caller owns the returned transport.
+util::StatusOr<Transport *> connectTransport(const QString &location,
+                                             int speed = 115200);
+
+#endif /* CS_MFT_SRC_TRANSPORT_H_ */